@@ -191,6 +191,8 @@
 	  if (_earliestTime == 0)
 	    _earliestTime = act::month_time(year, month - 1);
 
+	  [dbm beginLoadingActivities];
+
 	  time_t min_time = std::max(_earliestTime, range.start);
 
 	  while (1)
@@ -236,6 +238,8 @@
 	      month--;
 	    }
 
+	  [dbm endLoadingActivities];
+
 	  _moreItems = _earliestTime > range.start;
 	}
 
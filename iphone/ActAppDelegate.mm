@@ -32,6 +32,7 @@
 #import "ActQueryListViewController.h"
 
 #import "act-config.h"
+#import "act-gps-summary-cache.h"
 
 @implementation ActAppDelegate
 {
@@ -191,6 +192,10 @@ defaults_getenv(const char *key)
 {
   [[ActDatabaseManager sharedManager] synchronize];
   [[ActFileManager sharedManager] synchronize];
+
+  // The app may be killed without running static destructors.
+
+  act::gps_summary_cache::shared_cache().save();
 }
 
 - (void)applicationWillEnterForeground:(UIApplication *)app
@@ -51,6 +51,13 @@ extern NSString *const ActActivityDidChange;
 
 - (void)loadActivityFromPath:(NSString *)path revision:(NSString *)rev;
 
+/* Activities loaded between these calls are added to the database
+   together when the outermost -endLoadingActivities is called, with a
+   single ActActivityDatabaseDidChange notification. */
+
+- (void)beginLoadingActivities;
+- (void)endLoadingActivities;
+
 @property(nonatomic, readonly) act::database *database;
 
 - (void)activityDidChange:(const act::activity_storage_ref)storage;
@@ -53,6 +53,9 @@ NSString *const ActActivityDidChange = @"ActActivityDidChange";
 {
   std::unique_ptr<act::database> _database;
 
+  std::unique_ptr<act::database::batch> _loadBatch;
+  NSInteger _loadBatchDepth;
+
   NSMutableDictionary *_addedActivityRevisions;
 
   BOOL _databaseNeedsSynchronize;
@@ -116,13 +119,11 @@ static ActDatabaseManager *_sharedManager;
     {
       _databaseNeedsSynchronize = NO;
 
-      for (auto &it : _database->items())
-	{
-	  act::activity_storage_ref storage = it.storage();
+      std::vector<act::activity_storage_ref> storages;
+      _database->modified_storages(storages);
 
-	  if (storage->seed() != storage->path_seed())
-	    [self synchronizeStorage:storage];
-	}
+      for (const auto &storage : storages)
+	[self synchronizeStorage:storage];
     }
 }
 
@@ -214,7 +215,9 @@ static ActDatabaseManager *_sharedManager;
 	{
 	  _addedActivityRevisions[path] = rev;
 
-	  if (_database->add_activity([dest UTF8String]))
+	  if (_loadBatch)
+	    _loadBatch->add_activity([dest UTF8String]);
+	  else if (_database->add_activity([dest UTF8String]))
 	    {
 	      [[NSNotificationCenter defaultCenter]
 	       postNotificationName:ActActivityDatabaseDidChange object:self];
@@ -229,6 +232,28 @@ static ActDatabaseManager *_sharedManager;
     }
 }
 
+- (void)beginLoadingActivities
+{
+  if (_loadBatchDepth++ == 0)
+    _loadBatch.reset(new act::database::batch(*_database));
+}
+
+- (void)endLoadingActivities
+{
+  if (--_loadBatchDepth != 0)
+    return;
+
+  std::unique_ptr<act::database::batch> batch(std::move(_loadBatch));
+
+  if (batch->size() != 0)
+    {
+      batch->commit();
+
+      [[NSNotificationCenter defaultCenter]
+       postNotificationName:ActActivityDatabaseDidChange object:self];
+    }
+}
+
 - (void)fileCacheDidChange:(NSNotification *)note
 {
   ActAppDelegate *delegate = (id)[UIApplication sharedApplication].delegate;
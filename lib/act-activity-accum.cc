@@ -166,6 +166,58 @@ activity_accum::field_by_name(const char *name, accum_field &ret)
     }
 }
 
+field_id
+activity_accum::accum_field_id(accum_field field)
+{
+  switch (field)
+    {
+    case accum_field::distance:
+      return field_id::distance;
+    case accum_field::duration:
+      return field_id::duration;
+    case accum_field::speed:
+      return field_id::speed;
+    case accum_field::max_speed:
+      return field_id::max_speed;
+    case accum_field::avg_hr:
+      return field_id::avg_hr;
+    case accum_field::max_hr:
+      return field_id::max_hr;
+    case accum_field::resting_hr:
+      return field_id::resting_hr;
+    case accum_field::avg_cadence:
+      return field_id::avg_cadence;
+    case accum_field::max_cadence:
+      return field_id::max_cadence;
+    case accum_field::avg_stance_time:
+      return field_id::avg_stance_time;
+    case accum_field::avg_stance_ratio:
+      return field_id::avg_stance_ratio;
+    case accum_field::avg_vertical_oscillation:
+      return field_id::avg_vertical_oscillation;
+    case accum_field::avg_stride_length:
+      return field_id::avg_stride_length;
+    case accum_field::calories:
+      return field_id::calories;
+    case accum_field::training_effect:
+      return field_id::training_effect;
+    case accum_field::weight:
+      return field_id::weight;
+    case accum_field::effort:
+      return field_id::effort;
+    case accum_field::quality:
+      return field_id::quality;
+    case accum_field::points:
+      return field_id::points;
+    case accum_field::temperature:
+      return field_id::temperature;
+    case accum_field::dew_point:
+      return field_id::dew_point;
+    }
+
+  return field_id::custom;
+}
+
 std::vector<activity_accum::accum_field>
 activity_accum::format_fields(const char *format)
 {
@@ -348,6 +400,18 @@ activity_accum::add(const activity &a)
     }
 }
 
+void
+activity_accum::add(const double *values)
+{
+  _count++;
+
+  for (size_t i = 0; i < _accum.size(); i++)
+    {
+      if (double x = values[i])
+	_accum[i].add(x);
+    }
+}
+
 void
 activity_accum::printf(const char *format, const char *key) const
 {
@@ -92,10 +92,19 @@ public:
   static bool field_by_name(const char *name, accum_field &ret);
   static std::vector<accum_field> format_fields(const char *format);
 
+  /* The field whose activity::field_value() is accumulated. */
+
+  static field_id accum_field_id(accum_field field);
+
   activity_accum(const std::vector<accum_field> &fields);
 
   void add(const activity &a);
 
+  /* VALUES[i] is the value of the i'th field given to the
+     constructor, zero meaning undefined. */
+
+  void add(const double *values);
+
   void printf(const char *format, const char *key) const;
 
   void print_row(output_table &out, const char *format, const char *key) const;
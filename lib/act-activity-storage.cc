@@ -27,13 +27,179 @@
 #include "act-config.h"
 #include "act-util.h"
 
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <unistd.h>
 #include <xlocale.h>
 
+// Beyond this many fields activity_storage falls back to linear search.
+
+#define MAX_INDEXED_FIELDS 0x7fff
+
 namespace act {
 
+/* The intern table. Entries are never freed, so atoms can hold plain
+   pointers to them. Files are read on several threads, so access is
+   serialized; lookups by name don't need the table. */
+
+const field_atom::data *
+field_atom::intern(const char *name, size_t len)
+{
+  static std::mutex mutex;
+  static std::unordered_map<std::string, const data *> *table;
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (table == nullptr)
+    table = new std::unordered_map<std::string, const data *>;
+
+  std::string key(name, len);
+
+  auto it = table->find(key);
+  if (it != table->end())
+    return it->second;
+
+  data *d = new data;
+  d->name = key;
+  d->hash = hash(name, len);
+
+  switch (lookup_field_id(d->name.c_str()))
+    {
+    case field_id::activity:
+    case field_id::type:
+      d->pooled_value = true;
+      break;
+    default:
+      d->pooled_value = false;
+    }
+
+  (*table)[key] = d;
+  return d;
+}
+
+const field_atom::data *
+field_atom::empty_data()
+{
+  static const data *d = intern("", 0);
+  return d;
+}
+
+uint32_t
+field_atom::hash(const char *name, size_t len)
+{
+  // FNV-1a of the ASCII-lowercased name, matching strcasecmp_l()
+  // in the C locale.
+
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < len; i++)
+    {
+      uint8_t c = name[i];
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      h = (h ^ c) * 16777619U;
+    }
+  return h;
+}
+
+namespace {
+
+std::mutex value_pool_mutex;
+std::unordered_map<std::string, const value_pool::entry *> *value_table;
+std::unordered_map<std::string, const value_pool::entry *> *folded_table;
+
+} // anonymous namespace
+
+value_pool::handle
+value_pool::intern(const std::string &str)
+{
+  std::lock_guard<std::mutex> lock(value_pool_mutex);
+
+  if (value_table == nullptr)
+    {
+      value_table = new std::unordered_map<std::string, const entry *>;
+      folded_table = new std::unordered_map<std::string, const entry *>;
+    }
+
+  auto it = value_table->find(str);
+  if (it != value_table->end())
+    return it->second;
+
+  std::string folded(str);
+  for (auto &c : folded)
+    {
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+    }
+
+  entry *e = new entry;
+  e->str = str;
+
+  auto it2 = folded_table->find(folded);
+  if (it2 != folded_table->end())
+    e->folded = it2->second;
+  else
+    {
+      e->folded = e;
+      (*folded_table)[folded] = e;
+    }
+
+  (*value_table)[str] = e;
+  return e;
+}
+
+value_pool::handle
+value_pool::find(const std::string &str)
+{
+  std::lock_guard<std::mutex> lock(value_pool_mutex);
+
+  if (value_table == nullptr)
+    return nullptr;
+
+  auto it = value_table->find(str);
+  return it != value_table->end() ? it->second : nullptr;
+}
+
+struct activity_storage::parsed_values
+{
+  static const size_t FIELD_COUNT = (size_t)field_id::custom + 1;
+
+  // Zero if the slot is empty, one while it's being filled, two once
+  // VALUES[i] may be read.
+
+  std::atomic<uint8_t> state[FIELD_COUNT];
+  parsed_value values[FIELD_COUNT];
+
+  parsed_values();
+};
+
+activity_storage::parsed_values::parsed_values()
+{
+  for (auto &it : state)
+    it.store(0, std::memory_order_relaxed);
+}
+
+namespace {
+
+// Protects the deferred-body members, see load_body().
+
+std::mutex &
+body_mutex()
+{
+  static std::mutex mutex;
+  return mutex;
+}
+
+} // anonymous namespace
+
 activity_storage::activity_storage()
 : _seed(0),
-  _path_seed(0)
+  _path_seed(0),
+  _in_dirty_set(false),
+  _body_deferred(false),
+  _body_offset(-1),
+  _parsed_values(nullptr)
 {
 }
 
@@ -41,16 +207,30 @@ activity_storage::activity_storage(const activity_storage &rhs)
 : _seed(rhs._seed),
   _path(rhs._path),
   _path_seed(rhs._path_seed),
+  _written_file(rhs._written_file),
+  _in_dirty_set(false),
   _header(rhs._header),
-  _body(rhs._body)
+  _slots(rhs._slots),
+  _handles(rhs._handles),
+  _body_deferred(false),
+  _parsed_values(nullptr)
 {
+  copy_body(rhs);
+}
+
+activity_storage::~activity_storage()
+{
+  delete _parsed_values.load(std::memory_order_relaxed);
 }
 
 activity_storage &
 activity_storage::operator= (const activity_storage &rhs)
 {
   _header = rhs._header;
-  _body = rhs._body;
+  _slots = rhs._slots;
+  _handles = rhs._handles;
+
+  copy_body(rhs);
 
   increment_seed();
 
@@ -65,63 +245,209 @@ activity_storage::set_path(const char *path)
 }
 
 bool
-activity_storage::read_file(const char *path)
+activity_storage::read_file(const char *path, bool with_body)
 {
-  FILE_ptr fh(fopen(path, "r"));
-  if (!fh)
+  mapped_file file;
+  if (!file.map(path))
     return false;
 
   _header.clear();
+  _slots.clear();
+  _handles.clear();
   _body.clear();
+  _body_path.clear();
+  _body_deferred.store(false, std::memory_order_release);
+
+  const char *ptr = file.data();
+  const char *end = ptr + file.size();
 
   std::string *last_value = nullptr;
 
   /* Using normal email-header rules: first empty line completes header
      section, and leading whitespace can be used to append a line onto
-     the previous header. */
+     the previous header. Strings are built directly from the mapped
+     file, with no intermediate line buffer. */
 
-  char buf[4096];
-  while (fgets(buf, sizeof(buf), fh.get()))
+  while (ptr < end)
     {
-      if (buf[0] == '\n')
-	break;
+      const char *eol = static_cast<const char *>(memchr(ptr, '\n',
+							  end - ptr));
+      const char *next = eol ? eol + 1 : end;
 
-      if (_header.size() == 0 || !isspace_l(buf[0], nullptr))
+      if (ptr[0] == '\n')
 	{
-	  char *ptr = strchr(buf, ':');
-	  if (ptr == nullptr)
-	    continue;
+	  ptr = next;
+	  break;
+	}
 
-	  *ptr++ = 0;
+      if (_header.size() == 0 || !isspace_l(ptr[0], nullptr))
+	{
+	  const char *colon = static_cast<const char *>(memchr(ptr, ':',
+							      next - ptr));
+	  if (colon != nullptr)
+	    {
+	      size_t name_len = colon - ptr;
+
+	      const char *value = colon + 1;
+	      while (value < next && isspace_l(*value, nullptr))
+		value++;
+
+	      const char *value_end = next;
+	      while (value_end > value + 1
+		     && (value_end[-1] == '\n' || value_end[-1] == '\r'))
+		value_end--;
+
+	      int idx = find_field(ptr, name_len,
+				   field_atom::hash(ptr, name_len));
+	      if (idx < 0)
+		{
+		  idx = (int)_header.size();
+		  _header.resize(idx + 1);
+		  _header[idx].first = field_atom(ptr, name_len);
+		  insert_slot(idx);
+		}
+
+	      last_value = &_header[idx].second;
+	      last_value->assign(value, value_end - value);
+	    }
+	}
+      else if (last_value != nullptr)
+	{
+	  const char *line_end = next;
+	  while (line_end > ptr + 1
+		 && (line_end[-1] == '\n' || line_end[-1] == '\r'))
+	    line_end--;
 
-	  last_value = &(*this)[buf];
+	  last_value->append(ptr, line_end - ptr);
+	}
 
-	  while (*ptr && isspace_l(*ptr, nullptr))
-	    ptr++;
+      ptr = next;
+    }
 
-	  trim_newline_characters(ptr);
-	  *last_value = ptr;
-	}
-      else
+  _body_offset = ptr - file.data();
+
+  if (!with_body)
+    {
+      if (ptr < end)
 	{
-	  trim_newline_characters(buf);
-	  if (last_value != nullptr)
-	    last_value->append(buf);
+	  _body_path = path;
+	  _body_file = file.identity();
+	  _body_deferred.store(true, std::memory_order_release);
 	}
     }
+  else if (ptr < end)
+    _body.assign(ptr, end - ptr);
 
-  while (fgets(buf, sizeof(buf), fh.get()))
-    _body.append(buf);
-
+  update_value_handles();
   increment_seed();
 
   return true;
 }
 
+void
+activity_storage::defer_body(const char *path, const file_identity &id,
+			     int64_t offset)
+{
+  _body.clear();
+  _body_path = path;
+  _body_file = id;
+  _body_offset = offset;
+  _body_deferred.store(true, std::memory_order_release);
+}
+
+/* A deferred body stays deferred in the copy, so it's still checked
+   against the file it came from when finally read. */
+
+void
+activity_storage::copy_body(const activity_storage &rhs)
+{
+  if (&rhs == this)
+    return;
+
+  std::lock_guard<std::mutex> lock(body_mutex());
+
+  if (rhs._body_deferred.load(std::memory_order_relaxed))
+    {
+      _body.clear();
+      _body_path = rhs._body_path;
+      _body_file = rhs._body_file;
+      _body_deferred.store(true, std::memory_order_release);
+    }
+  else
+    {
+      _body = rhs._body;
+      _body_path.clear();
+      _body_deferred.store(false, std::memory_order_release);
+    }
+
+  _body_offset = rhs._body_offset;
+}
+
+/* Called when body() finds the body hasn't been read yet. Queries may
+   be evaluated on several threads: the file is read without holding
+   the lock, so loads of different storages proceed in parallel, and
+   the body is published under it (threads racing to load the same
+   body each read it, the first to finish wins). Callers only look at
+   _body once _body_deferred has been cleared.
+   Returns false if the file couldn't be read, or has changed since
+   the header was read (so the offset may no longer be where the body
+   is), leaving the body empty and still deferred. Writing the
+   storage fails until it's reloaded. */
+
 bool
-activity_storage::write_file(const char *path) const
+activity_storage::load_body() const
+{
+  std::mutex &mutex = body_mutex();
+
+  std::string path;
+  file_identity id;
+  int64_t offset;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!_body_deferred.load(std::memory_order_relaxed))
+      return true;
+
+    path = _body_path;
+    id = _body_file;
+    offset = _body_offset;
+  }
+
+  std::string body;
+
+  {
+    mapped_file file;
+    if (!file.map(path.c_str()) || file.identity() != id)
+      return false;
+
+    if (offset >= 0 && (size_t)offset < file.size())
+      body.assign(file.data() + offset, file.size() - offset);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (!_body_deferred.load(std::memory_order_relaxed))
+    return true;
+
+  _body.swap(body);
+  std::string().swap(_body_path);
+  _body_deferred.store(false, std::memory_order_release);
+
+  return true;
+}
+
+bool
+activity_storage::write_temp_file(const char *path, std::string &tmp_path,
+				  std::string &dest_path) const
 {
-  FILE_ptr fh(fopen(path, "w"));
+  // The body must be read before PATH is replaced, it may be the
+  // file the body is deferred from.
+
+  if (!body_loaded() && !load_body())
+    return false;
+
+  FILE_ptr fh(open_replacement_file(path, tmp_path, dest_path));
   if (!fh)
     return false;
 
@@ -132,6 +458,41 @@ activity_storage::write_file(const char *path) const
 
   fputs(_body.c_str(), fh.get());
 
+  if (fflush(fh.get()) != 0 || ferror(fh.get()))
+    {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+
+  return true;
+}
+
+bool
+activity_storage::write_file(const char *path) const
+{
+  std::string tmp_path, dest_path;
+  if (!write_temp_file(path, tmp_path, dest_path))
+    return false;
+
+  bool sync = shared_config().sync_writes();
+
+  if ((sync && !sync_path(tmp_path.c_str()))
+      || rename(tmp_path.c_str(), dest_path.c_str()) != 0)
+    {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+
+  struct stat st;
+  if (stat(dest_path.c_str(), &st) == 0)
+    _written_file = file_identity(st);
+
+  if (sync)
+    {
+      std::string dir(dest_path, 0, dest_path.rfind('/') + 1);
+      sync_path(dir.size() != 0 ? dir.c_str() : ".");
+    }
+
   return true;
 }
 
@@ -147,6 +508,106 @@ activity_storage::synchronize_file() const
   _path_seed = _seed;
 }
 
+void
+activity_storage::set_dirty_set(const std::shared_ptr<activity_dirty_set> &set)
+{
+  _dirty_set = set;
+  _in_dirty_set = false;
+
+  if (_dirty_set && _seed != _path_seed)
+    _dirty_set->add(this);
+}
+
+activity_dirty_set::activity_dirty_set()
+: _journaling(false),
+  _journal_start(0)
+{
+}
+
+void
+activity_dirty_set::add(activity_storage *storage)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (!storage->_in_dirty_set)
+    {
+      storage->_in_dirty_set = true;
+      _storages.push_back(storage->shared_from_this());
+    }
+
+  if (_journaling && (_journal.size() == 0 || _journal.back() != storage))
+    _journal.push_back(storage);
+}
+
+void
+activity_dirty_set::modified_storages(std::vector<activity_storage_ref>
+				      &storages)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  size_t count = 0;
+
+  for (size_t i = 0; i < _storages.size(); i++)
+    {
+      activity_storage_ref storage = _storages[i].lock();
+      if (!storage)
+	continue;
+
+      if (storage->seed() != storage->path_seed())
+	{
+	  storages.push_back(storage);
+	  _storages[count++] = _storages[i];
+	}
+      else if (storage->_dirty_set.get() == this)
+	storage->_in_dirty_set = false;
+    }
+
+  _storages.resize(count);
+}
+
+void
+activity_dirty_set::set_journaling(bool flag)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _journaling = flag;
+
+  if (!flag)
+    {
+      _journal_start += _journal.size();
+      _journal.clear();
+    }
+}
+
+uint64_t
+activity_dirty_set::journal_since(uint64_t serial,
+				  std::vector<const activity_storage *>
+				  &storages)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  size_t i = serial > _journal_start ? serial - _journal_start : 0;
+
+  for (; i < _journal.size(); i++)
+    storages.push_back(_journal[i]);
+
+  return _journal_start + _journal.size();
+}
+
+void
+activity_dirty_set::trim_journal(uint64_t serial)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (serial > _journal_start)
+    {
+      size_t count = std::min<uint64_t>(serial - _journal_start,
+					 _journal.size());
+      _journal.erase(_journal.begin(), _journal.begin() + count);
+      _journal_start += count;
+    }
+}
+
 void
 activity_storage::canonicalize_field_order()
 {
@@ -156,30 +617,95 @@ activity_storage::canonicalize_field_order()
 		     field_id b_id = lookup_field_id(b.first.c_str());
 		     return a_id < b_id;
 		   });
+
+  rebuild_slots();
+  _handles.clear();
 }
 
 int
-activity_storage::field_index(const char *name) const
+activity_storage::find_field(const char *name, size_t len,
+			     uint32_t hash) const
 {
-  for (const auto &it : _header)
+  if (_slots.size() == 0)
     {
-      if (strcasecmp_l(it.first.c_str(), name, nullptr) == 0)
-	return (int)(&it - &_header[0]);
+      for (const auto &it : _header)
+	{
+	  if (it.first.size() == len
+	      && strncasecmp_l(it.first.c_str(), name, len, nullptr) == 0)
+	    return (int)(&it - &_header[0]);
+	}
+
+      return -1;
+    }
+
+  size_t mask = _slots.size() - 1;
+
+  for (size_t i = hash & mask; _slots[i] != 0; i = (i + 1) & mask)
+    {
+      const field_atom &atom = _header[_slots[i] - 1].first;
+      if (atom.hash() == hash && atom.size() == len
+	  && strncasecmp_l(atom.c_str(), name, len, nullptr) == 0)
+	return _slots[i] - 1;
     }
 
   return -1;
 }
 
+void
+activity_storage::insert_slot(size_t idx)
+{
+  if (_header.size() * 2 > _slots.size())
+    {
+      rebuild_slots();
+      return;
+    }
+
+  const field_atom &atom = _header[idx].first;
+  size_t mask = _slots.size() - 1;
+
+  size_t i = atom.hash() & mask;
+  for (; _slots[i] != 0; i = (i + 1) & mask)
+    {
+      const field_atom &other = _header[_slots[i] - 1].first;
+      if (other.hash() == atom.hash() && other.size() == atom.size()
+	  && strcasecmp_l(other.c_str(), atom.c_str(), nullptr) == 0)
+	return;
+    }
+
+  _slots[i] = idx + 1;
+}
+
+void
+activity_storage::rebuild_slots()
+{
+  _slots.clear();
+
+  if (_header.size() == 0 || _header.size() > MAX_INDEXED_FIELDS)
+    return;
+
+  size_t size = 16;
+  while (size < _header.size() * 2)
+    size *= 2;
+
+  _slots.resize(size);
+
+  for (size_t idx = 0; idx < _header.size(); idx++)
+    insert_slot(idx);
+}
+
 std::string &
 activity_storage::operator[](const char *name)
 {
   int idx = field_index(name);
 
+  _handles.clear();
+
   if (idx < 0)
     {
       idx = (int)_header.size();
       _header.resize(idx+1);
       _header[idx].first = name;
+      insert_slot(idx);
       increment_seed();
     }
 
@@ -199,6 +725,8 @@ activity_storage::delete_field(size_t idx)
   if (idx < _header.size())
     {
       _header.erase(_header.begin() + idx);
+      rebuild_slots();
+      _handles.clear();
       increment_seed();
     }
 }
@@ -244,7 +772,11 @@ activity_storage::delete_empty_fields()
     }
 
   if (modified)
-    increment_seed();
+    {
+      rebuild_slots();
+      _handles.clear();
+      increment_seed();
+    }
 }
 
 bool
@@ -257,6 +789,8 @@ activity_storage::set_field_name(const std::string &old_name,
     return false;
 
   _header[idx].first = new_name;
+  rebuild_slots();
+  _handles.clear();
   increment_seed();
 
   return true;
@@ -304,4 +838,70 @@ activity_storage::field_read_only_p(const char *name) const
   return false;
 }
 
+void
+activity_storage::update_value_handles()
+{
+  _handles.resize(_header.size());
+
+  for (size_t i = 0; i < _header.size(); i++)
+    {
+      if (_header[i].first.pooled_value_p())
+	_handles[i] = value_pool::intern(_header[i].second);
+      else
+	_handles[i] = nullptr;
+    }
+}
+
+/* Only called by increment_seed(), which like any other modification
+   mustn't race with readers. */
+
+void
+activity_storage::clear_parsed_values()
+{
+  delete _parsed_values.exchange(nullptr, std::memory_order_acq_rel);
+}
+
+bool
+activity_storage::find_parsed_value(field_id id, parsed_value &value) const
+{
+  parsed_values *p = _parsed_values.load(std::memory_order_acquire);
+  if (p == nullptr)
+    return false;
+
+  size_t idx = (size_t)id;
+  if (p->state[idx].load(std::memory_order_acquire) != 2)
+    return false;
+
+  value = p->values[idx];
+  return true;
+}
+
+void
+activity_storage::set_parsed_value(field_id id,
+				   const parsed_value &value) const
+{
+  parsed_values *p = _parsed_values.load(std::memory_order_acquire);
+
+  if (p == nullptr)
+    {
+      parsed_values *p_new = new parsed_values;
+      if (_parsed_values.compare_exchange_strong(p, p_new,
+						 std::memory_order_acq_rel))
+	p = p_new;
+      else
+	delete p_new;
+    }
+
+  // If another thread got here first it stored the same value.
+
+  size_t idx = (size_t)id;
+  uint8_t empty = 0;
+  if (p->state[idx].compare_exchange_strong(empty, 1,
+					    std::memory_order_acquire))
+    {
+      p->values[idx] = value;
+      p->state[idx].store(2, std::memory_order_release);
+    }
+}
+
 } // namespace act
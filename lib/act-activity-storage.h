@@ -26,31 +26,169 @@
 #define ACT_ACTIVITY_STORAGE_H
 
 #include "act-base.h"
+#include "act-types.h"
+#include "act-util.h"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include <string.h>
+
 namespace act {
 
-class activity_storage : public uncopyable
+/* An interned header field name. Each distinct spelling is stored
+   once per process, so copying an atom is just copying a pointer.
+   Atoms convert to the name string, and carry a hash of the
+   case-folded name for activity_storage's field lookups. */
+
+class field_atom
+{
+  struct data
+    {
+      std::string name;
+      uint32_t hash;
+      bool pooled_value;
+    };
+
+  const data *_data;
+
+  static const data *intern(const char *name, size_t len);
+  static const data *empty_data();
+
+public:
+  field_atom();
+  field_atom(const char *name);
+  field_atom(const char *name, size_t len);
+  field_atom(const std::string &name);
+
+  const std::string &str() const;
+  const char *c_str() const;
+  size_t size() const;
+
+  operator const std::string &() const;
+
+  uint32_t hash() const;
+
+  // True if values of this field are added to value_pool.
+
+  bool pooled_value_p() const;
+
+  // Hash of the case-folded characters of NAME.
+
+  static uint32_t hash(const char *name, size_t len);
+};
+
+/* Process-wide pool of the values of the enumerated header fields
+   (Activity and Type). Equal strings share one entry, and all entries
+   whose strings only differ in case share the same 'folded' entry, so
+   values can be compared, or grouped ignoring case, by pointer.
+   Entries are never freed, so free-text fields aren't pooled. */
+
+class value_pool
 {
-  // Using a vector here to preserve ordering. Could add a map of
-  // some sort later if we need faster lookups.
+public:
+  struct entry
+    {
+      std::string str;
+      const entry *folded;
+    };
 
-  typedef std::vector<std::pair<std::string, std::string>> field_map;
+  typedef const entry *handle;
+
+  static handle intern(const std::string &str);
+
+  // The entry of STR if it has been interned, otherwise null.
+
+  static handle find(const std::string &str);
+};
+
+class activity_dirty_set;
+
+class activity_storage : public uncopyable,
+  public std::enable_shared_from_this<activity_storage>
+{
+  // Using a vector here to preserve ordering. _slots is an
+  // open-addressed hash table mapping the case-folded field names to
+  // their indices (plus one, zero is an empty slot), only the first
+  // of any duplicated names is included. It's empty when _header is,
+  // or if there are too many fields to index.
+
+  typedef std::vector<std::pair<field_atom, std::string>> field_map;
 
   uint32_t _seed;
 
   std::string _path;
   mutable uint32_t _path_seed;
+  mutable file_identity _written_file;
+
+  // The set this storage adds itself to when its seed changes, see
+  // activity_dirty_set. _in_dirty_set is protected by the set's lock.
+
+  std::shared_ptr<activity_dirty_set> _dirty_set;
+  bool _in_dirty_set;
+
+  friend class activity_dirty_set;
 
   field_map _header;
-  std::string _body;
+  std::vector<uint16_t> _slots;
+
+  // Pool handles of the header values (null for fields that aren't
+  // pooled). Either empty or parallel to _header, it's cleared by
+  // anything that could modify a value.
+
+  std::vector<value_pool::handle> _handles;
+
+  int find_field(const char *name, size_t len, uint32_t hash) const;
+  void insert_slot(size_t idx);
+  void rebuild_slots();
+
+  // If _body_deferred is set, the body hasn't been read yet and is
+  // loaded from _body_path on first access, provided the file still
+  // matches _body_file. _body_offset is the position of the body in
+  // the file it was read from, or -1.
+
+  mutable std::string _body;
+  mutable std::atomic<bool> _body_deferred;
+  mutable std::string _body_path;
+  file_identity _body_file;
+  int64_t _body_offset;
+
+  void copy_body(const activity_storage &rhs);
+  bool load_body() const;
+
+public:
+  // A header field's value as parsed by activity: VALUE and UNIT are
+  // the parser's outputs (or the defaults the parse started from),
+  // PRESENT is false if the field doesn't exist, and VALID is false
+  // if its string couldn't be fully parsed.
+
+  struct parsed_value
+    {
+      double value;
+      unit_type unit;
+      bool present;
+      bool valid;
+    };
+
+private:
+  // Parsed values indexed by field_id, created on first use and
+  // discarded when the seed changes, so they outlive the activity
+  // objects that share this storage. Slots are filled at most once,
+  // and may be read and filled from several threads.
+
+  struct parsed_values;
+
+  mutable std::atomic<parsed_values *> _parsed_values;
+
+  void clear_parsed_values();
 
 public:
   activity_storage();
   activity_storage(const activity_storage &rhs);
+  ~activity_storage();
 
   // only copies the contents, not the seeds and path.
 
@@ -65,12 +203,47 @@ public:
   uint32_t path_seed() const;
   void set_path_seed(uint32_t seed);
 
-  bool read_file(const char *path);
+  // The file as it was after this storage last wrote it, so changes
+  // made by other processes can be told apart from our own writes.
+
+  const file_identity &written_file() const;
+  void set_written_file(const file_identity &id);
+
+  // If WITH_BODY is false only the header is parsed, and the body is
+  // read from PATH the first time body() is called.
+
+  bool read_file(const char *path, bool with_body = true);
+
+  // Replaces PATH atomically, by writing a temporary file and
+  // renaming it over PATH. If the sync-writes option is set the data
+  // is flushed to disk first.
+
   bool write_file(const char *path) const;
 
+  // The first half of write_file(): writes the temporary file but
+  // doesn't rename it to DEST_PATH (PATH, or the file it links to).
+
+  bool write_temp_file(const char *path, std::string &tmp_path,
+    std::string &dest_path) const;
+
+  // Discards the body, it will be read from OFFSET in PATH when
+  // next accessed. ID is the identity of the file the header came
+  // from, if PATH no longer matches it the body can't be loaded.
+
+  void defer_body(const char *path, const file_identity &id,
+    int64_t offset);
+
+  bool body_loaded() const;
+  int64_t body_offset() const;
+  void set_body_offset(int64_t offset);
+
   bool needs_synchronize() const;
   void synchronize_file() const;
 
+  // Called by the database containing the storage.
+
+  void set_dirty_set(const std::shared_ptr<activity_dirty_set> &set);
+
   void canonicalize_field_order();
 
   std::string &body();
@@ -104,6 +277,23 @@ public:
 
   bool field_read_only_p(const char *name) const;
 
+  // Returns the value_pool handle of field IDX's value, or null if
+  // it's not a pooled field or may have been modified since the
+  // handles were last updated.
+
+  value_pool::handle value_handle(size_t idx) const;
+
+  void update_value_handles();
+
+  // Returns false if field ID hasn't been parsed since the seed last
+  // changed, otherwise sets VALUE to the stored result.
+
+  bool find_parsed_value(field_id id, parsed_value &value) const;
+
+  // Stores the result of parsing field ID, unless it already has one.
+
+  void set_parsed_value(field_id id, const parsed_value &value) const;
+
   typedef field_map::iterator iterator;
   typedef field_map::const_iterator const_iterator;
   typedef field_map::value_type value_type;
@@ -119,8 +309,110 @@ public:
 typedef std::shared_ptr<activity_storage> activity_storage_ref;
 typedef std::shared_ptr<const activity_storage> const_activity_storage_ref;
 
+/* The storages of a database that may have been modified since they
+   were last written, so that synchronizing doesn't need to visit
+   every activity. Registered storages add themselves whenever their
+   seed changes; only weak references are kept.
+
+   While journaling is enabled every seed change is also appended to
+   a journal, read by database::live_query. Journal entries are
+   numbered in order and are only compared against storages the
+   reader holds references to, so they're not dereferenced. */
+
+class activity_dirty_set : public uncopyable
+{
+  std::mutex _mutex;
+  std::vector<std::weak_ptr<activity_storage>> _storages;
+
+  bool _journaling;
+  uint64_t _journal_start;		// number of _journal[0]
+  std::vector<const activity_storage *> _journal;
+
+public:
+  activity_dirty_set();
+
+  void add(activity_storage *storage);
+
+  // Appends the storages whose seed differs from their path seed to
+  // STORAGES, forgetting the others.
+
+  void modified_storages(std::vector<activity_storage_ref> &storages);
+
+  void set_journaling(bool flag);
+
+  // Appends the storages changed since journal entry SERIAL to
+  // STORAGES, returns the number of the next entry.
+
+  uint64_t journal_since(uint64_t serial,
+    std::vector<const activity_storage *> &storages);
+
+  // Forgets the entries before SERIAL.
+
+  void trim_journal(uint64_t serial);
+};
+
 // implementation details
 
+inline
+field_atom::field_atom()
+: _data(empty_data())
+{
+}
+
+inline
+field_atom::field_atom(const char *name)
+: _data(intern(name, strlen(name)))
+{
+}
+
+inline
+field_atom::field_atom(const char *name, size_t len)
+: _data(intern(name, len))
+{
+}
+
+inline
+field_atom::field_atom(const std::string &name)
+: _data(intern(name.c_str(), name.size()))
+{
+}
+
+inline const std::string &
+field_atom::str() const
+{
+  return _data->name;
+}
+
+inline const char *
+field_atom::c_str() const
+{
+  return _data->name.c_str();
+}
+
+inline size_t
+field_atom::size() const
+{
+  return _data->name.size();
+}
+
+inline
+field_atom::operator const std::string &() const
+{
+  return _data->name;
+}
+
+inline uint32_t
+field_atom::hash() const
+{
+  return _data->hash;
+}
+
+inline bool
+field_atom::pooled_value_p() const
+{
+  return _data->pooled_value;
+}
+
 inline const char *
 activity_storage::path() const
 {
@@ -137,6 +429,12 @@ inline void
 activity_storage::increment_seed()
 {
   _seed++;
+
+  if (_parsed_values.load(std::memory_order_relaxed) != nullptr)
+    clear_parsed_values();
+
+  if (_dirty_set)
+    _dirty_set->add(this);
 }
 
 inline uint32_t
@@ -151,21 +449,55 @@ activity_storage::set_path_seed(uint32_t seed)
   _path_seed = seed;
 }
 
+inline const file_identity &
+activity_storage::written_file() const
+{
+  return _written_file;
+}
+
+inline void
+activity_storage::set_written_file(const file_identity &id)
+{
+  _written_file = id;
+}
+
 inline bool
 activity_storage::needs_synchronize() const
 {
   return _path.size() != 0 && _path_seed != _seed;
 }
 
+inline bool
+activity_storage::body_loaded() const
+{
+  return !_body_deferred.load(std::memory_order_acquire);
+}
+
+inline int64_t
+activity_storage::body_offset() const
+{
+  return _body_offset;
+}
+
+inline void
+activity_storage::set_body_offset(int64_t offset)
+{
+  _body_offset = offset;
+}
+
 inline const std::string &
 activity_storage::body() const
 {
+  if (!body_loaded())
+    load_body();
   return _body;
 }
 
 inline std::string &
 activity_storage::body()
 {
+  if (!body_loaded())
+    load_body();
   return _body;
 }
 
@@ -181,15 +513,30 @@ activity_storage::field_name(size_t idx) const
   return _header[idx].first;
 }
 
+inline value_pool::handle
+activity_storage::value_handle(size_t idx) const
+{
+  return idx < _handles.size() ? _handles[idx] : nullptr;
+}
+
+inline int
+activity_storage::field_index(const char *name) const
+{
+  size_t len = strlen(name);
+  return find_field(name, len, field_atom::hash(name, len));
+}
+
 inline int
 activity_storage::field_index(const std::string &name) const
 {
-  return field_index(name.c_str());
+  return find_field(name.c_str(), name.size(),
+		    field_atom::hash(name.c_str(), name.size()));
 }
 
 inline std::string &
 activity_storage::operator[](size_t idx)
 {
+  _handles.clear();
   return _header[idx].second;
 }
 
@@ -220,12 +567,14 @@ activity_storage::delete_field(const std::string &name)
 inline activity_storage::iterator
 activity_storage::begin()
 {
+  _handles.clear();
   return _header.begin();
 }
 
 inline activity_storage::iterator
 activity_storage::end()
 {
+  _handles.clear();
   return _header.end();
 }
 
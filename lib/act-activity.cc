@@ -26,6 +26,8 @@
 
 #include "act-config.h"
 #include "act-format.h"
+#include "act-gps-summary-cache.h"
+#include "act-gps-track-cache.h"
 #include "act-util.h"
 
 #include <cmath>
@@ -36,27 +38,100 @@ namespace act {
 activity::activity(activity_storage_ref storage)
 : _storage(storage),
   _gps_data_reader(nullptr),
+  _gps_data(nullptr),
+  _gps_summary(nullptr),
   _invalid_groups(group_all),
   _gps_dependent_groups(0),
   _seed(0)
 {
 }
 
+activity::~activity()
+{
+  delete _gps_summary.load(std::memory_order_relaxed);
+}
+
+namespace {
+
+// Adapters giving every field parser the signature parse_field()
+// expects.
+
+template<bool (*parse)(const std::string &, double *)> bool
+unitless(const std::string &str, double *value_ptr, unit_type *)
+{
+  return parse(str, value_ptr);
+}
+
+bool
+parse_date_value(const std::string &str, double *value_ptr, unit_type *)
+{
+  time_t date = (time_t) *value_ptr;
+  bool ret = parse_date_time(str, &date, nullptr);
+  *value_ptr = date;
+  return ret;
+}
+
+} // anonymous namespace
+
+/* Sets *VALUE_PTR (and *UNIT_PTR, if non-null) from header field ID,
+   parsing its string with PARSE unless the storage already holds the
+   result. On entry the outputs must hold the field's defaults, which
+   don't vary between activities. Returns false if the field is
+   missing. */
+
+bool
+activity::parse_field(field_id id, double *value_ptr, unit_type *unit_ptr,
+		      field_parser parse) const
+{
+  activity_storage::parsed_value v;
+
+  if (!_storage->find_parsed_value(id, v))
+    {
+      v.value = *value_ptr;
+      v.unit = unit_ptr ? *unit_ptr : unit_type::unknown;
+      v.present = false;
+      v.valid = false;
+
+      if (const std::string *s = field_ptr(canonical_field_name(id)))
+	{
+	  v.present = true;
+	  v.valid = parse(*s, &v.value, &v.unit);
+	}
+
+      _storage->set_parsed_value(id, v);
+    }
+
+  if (!v.present)
+    return false;
+
+  *value_ptr = v.value;
+  if (unit_ptr)
+    *unit_ptr = v.unit;
+
+  return true;
+}
+
 void
 activity::validate_cached_values(unsigned int groups) const
 {
-  if (_seed != _storage->seed())
-    _invalid_groups |= group_all;
+  uint32_t seed = _storage->seed();
 
-  if (_invalid_groups & groups)
-    {
-      groups = groups & _invalid_groups;
+  if (_seed.load(std::memory_order_acquire) == seed
+      && !(_invalid_groups.load(std::memory_order_acquire) & groups))
+    return;
 
-      if (groups == 0)
-	return;
+  std::lock_guard<std::mutex> lock(_mutex);
 
-      _invalid_groups &= ~groups;
+  if (_seed.load(std::memory_order_relaxed) != seed)
+    {
+      _invalid_groups.fetch_or(group_all, std::memory_order_relaxed);
+      _seed.store(seed, std::memory_order_release);
+    }
+
+  groups &= _invalid_groups.load(std::memory_order_relaxed);
 
+  if (groups != 0)
+    {
       const config &cfg = shared_config();
 
       if (groups & group_date)
@@ -124,8 +199,9 @@ activity::validate_cached_values(unsigned int groups) const
 
       if (groups & group_date)
 	{
-	  if (const std::string *s = field_ptr("date"))
-	    parse_date_time(*s, &_date, nullptr);
+	  double date = _date;
+	  if (parse_field(field_id::date, &date, nullptr, parse_date_value))
+	    _date = (time_t) date;
 
 	  if (_date == 0)
 	    gps_groups |= group_date;
@@ -133,16 +209,13 @@ activity::validate_cached_values(unsigned int groups) const
 
       if (groups & group_timing)
 	{
-	  if (const std::string *s = field_ptr("duration"))
-	    parse_duration(*s, &_duration);
-
-	  if (const std::string *s = field_ptr("distance"))
-	    parse_distance(*s, &_distance, &_distance_unit);
+	  parse_field(field_id::duration, &_duration, nullptr,
+		      unitless<parse_duration>);
+	  parse_field(field_id::distance, &_distance, &_distance_unit,
+		      parse_distance);
 
-	  if (const std::string *s = field_ptr("pace"))
-	    parse_pace(*s, &_speed, &_speed_unit);
-	  else if (const std::string *s = field_ptr("speed"))
-	    parse_speed(*s, &_speed, &_speed_unit);
+	  if (!parse_field(field_id::pace, &_speed, &_speed_unit, parse_pace))
+	    parse_field(field_id::speed, &_speed, &_speed_unit, parse_speed);
 
 	  if (_duration != 0 + _distance != 0 + _speed != 0 < 2)
 	    gps_groups |= group_timing;
@@ -150,19 +223,17 @@ activity::validate_cached_values(unsigned int groups) const
 
       if (groups & group_physiological)
 	{
-	  if (const std::string *s = field_ptr("resting-hr"))
-	    parse_heart_rate(*s, &_resting_hr, nullptr);
-	  if (const std::string *s = field_ptr("avg-hr"))
-	    parse_heart_rate(*s, &_avg_hr, nullptr);
-	  if (const std::string *s = field_ptr("max-hr"))
-	    parse_heart_rate(*s, &_max_hr, nullptr);
-
-	  if (const std::string *s = field_ptr("calories"))
-	    parse_number(*s, &_calories);
-	  if (const std::string *s = field_ptr("training-effect"))
-	    parse_number(*s, &_training_effect);
-	  if (const std::string *s = field_ptr("Weight"))
-	    parse_weight(*s, &_weight, &_weight_unit);
+	  parse_field(field_id::resting_hr, &_resting_hr, nullptr,
+		      parse_heart_rate);
+	  parse_field(field_id::avg_hr, &_avg_hr, nullptr, parse_heart_rate);
+	  parse_field(field_id::max_hr, &_max_hr, nullptr, parse_heart_rate);
+
+	  parse_field(field_id::calories, &_calories, nullptr,
+		      unitless<parse_number>);
+	  parse_field(field_id::training_effect, &_training_effect, nullptr,
+		      unitless<parse_number>);
+	  parse_field(field_id::weight, &_weight, &_weight_unit,
+		      parse_weight);
 
 	  if (_resting_hr == 0 || _avg_hr == 0 || _max_hr == 0
 	      || _calories == 0 || _training_effect == 0)
@@ -171,16 +242,19 @@ activity::validate_cached_values(unsigned int groups) const
 
       if (groups & group_gps_extended)
 	{
-	  if (const std::string *s = field_ptr("elapsed-time"))
-	    parse_duration(*s, &_elapsed_time);
-	  if (const std::string *s = field_ptr("ascent"))
-	    parse_distance(*s, &_ascent, &_ascent_unit);
-	  if (const std::string *s = field_ptr("descent"))
-	    parse_distance(*s, &_descent, &_descent_unit);
-	  if (const std::string *s = field_ptr("max-pace"))
-	    parse_pace(*s, &_max_speed, &_max_speed_unit);
-	  else if (const std::string *s = field_ptr("max-speed"))
-	    parse_speed(*s, &_max_speed, &_max_speed_unit);
+	  parse_field(field_id::elapsed_time, &_elapsed_time, nullptr,
+		      unitless<parse_duration>);
+	  parse_field(field_id::ascent, &_ascent, &_ascent_unit,
+		      parse_distance);
+	  parse_field(field_id::descent, &_descent, &_descent_unit,
+		      parse_distance);
+
+	  if (!parse_field(field_id::max_pace, &_max_speed, &_max_speed_unit,
+			   parse_pace))
+	    {
+	      parse_field(field_id::max_speed, &_max_speed, &_max_speed_unit,
+			  parse_speed);
+	    }
 
 	  if (_elapsed_time == 0 || _ascent == 0
 	      || _descent == 0 || _max_speed == 0)
@@ -189,16 +263,16 @@ activity::validate_cached_values(unsigned int groups) const
 
       if (groups & group_dynamics)
 	{
-	  if (const std::string *s = field_ptr("avg-cadence"))
-	    parse_cadence(*s, &_avg_cadence, nullptr);
-	  if (const std::string *s = field_ptr("max-cadence"))
-	    parse_cadence(*s, &_max_cadence, nullptr);
-	  if (const std::string *s = field_ptr("avg-stance-time"))
-	    parse_duration(*s, &_avg_stance_time);
-	  if (const std::string *s = field_ptr("avg-stance-ratio"))
-	    parse_duration(*s, &_avg_stance_ratio);
-	  if (const std::string *s = field_ptr("avg-vertical-oscillation"))
-	    parse_distance(*s, &_avg_vertical_oscillation, nullptr);
+	  parse_field(field_id::avg_cadence, &_avg_cadence, nullptr,
+		      parse_cadence);
+	  parse_field(field_id::max_cadence, &_max_cadence, nullptr,
+		      parse_cadence);
+	  parse_field(field_id::avg_stance_time, &_avg_stance_time, nullptr,
+		      unitless<parse_duration>);
+	  parse_field(field_id::avg_stance_ratio, &_avg_stance_ratio, nullptr,
+		      unitless<parse_duration>);
+	  parse_field(field_id::avg_vertical_oscillation,
+		      &_avg_vertical_oscillation, nullptr, parse_distance);
 
 	  if (_avg_cadence == 0 || _max_cadence == 0
 	      || _avg_stance_time == 0 || _avg_stance_ratio == 0
@@ -208,18 +282,17 @@ activity::validate_cached_values(unsigned int groups) const
 
       if (groups & group_other)
 	{
-	  if (const std::string *s = field_ptr("effort"))
-	    parse_fraction(*s, &_effort);
-	  if (const std::string *s = field_ptr("quality"))
-	    parse_fraction(*s, &_quality);
-	  if (const std::string *s = field_ptr("points"))
-	    parse_number(*s, &_points);
-
-	  if (const std::string *s = field_ptr("temperature"))
-	    parse_temperature(*s, &_temperature, &_temperature_unit);
-
-	  if (const std::string *s = field_ptr("dew-point"))
-	    parse_temperature(*s, &_dew_point, &_dew_point_unit);
+	  parse_field(field_id::effort, &_effort, nullptr,
+		      unitless<parse_fraction>);
+	  parse_field(field_id::quality, &_quality, nullptr,
+		      unitless<parse_fraction>);
+	  parse_field(field_id::points, &_points, nullptr,
+		      unitless<parse_number>);
+
+	  parse_field(field_id::temperature, &_temperature,
+		      &_temperature_unit, parse_temperature);
+	  parse_field(field_id::dew_point, &_dew_point, &_dew_point_unit,
+		      parse_temperature);
 
 	  if (const std::string *s = field_ptr("equipment"))
 	    parse_keywords(*s, &_equipment);
@@ -235,7 +308,7 @@ activity::validate_cached_values(unsigned int groups) const
 	{
 	  _gps_dependent_groups |= gps_groups;
 
-	  if (const gps::activity *data = gps_data())
+	  if (const gps::activity *data = gps_summary())
 	    {
 	      if (groups & group_date)
 		{
@@ -300,6 +373,10 @@ activity::validate_cached_values(unsigned int groups) const
 		}
 	    }
 	}
+
+      // Publish the new values.
+
+      _invalid_groups.fetch_and(~groups, std::memory_order_release);
     }
 }
 
@@ -521,14 +598,14 @@ activity::speed_unit() const
 double
 activity::max_speed() const
 {
-  validate_cached_values(group_timing);
+  validate_cached_values(group_gps_extended);
   return _max_speed;
 }
 
 unit_type
 activity::max_speed_unit() const
 {
-  validate_cached_values(group_timing);
+  validate_cached_values(group_gps_extended);
   return _max_speed_unit;
 }
 
@@ -987,38 +1064,133 @@ activity::print_field(FILE *fh, const char *field, const char *arg) const
 const gps::activity *
 activity::gps_data() const
 {
-  if (_gps_data == nullptr)
+  if (const gps::activity *a = _gps_data.load(std::memory_order_acquire))
+    return a;
+
+  std::lock_guard<std::mutex> lock(_gps_mutex);
+
+  if (const gps::activity *a = _gps_data.load(std::memory_order_relaxed))
+    return a;
+
+  if (_gps_data_reader != nullptr)
     {
-      if (_gps_data_reader != nullptr)
-	{
-	  gps::activity *a = _gps_data_reader->read_gps_file(*this);
-	  if (a != nullptr)
-	    _gps_data.reset(a);
-	}
-      else if (const std::string *str = field_ptr("gps-file"))
+      std::shared_ptr<const gps::activity>
+        a (_gps_data_reader->read_gps_file(*this));
+      return set_gps_track(std::move(a), nullptr);
+    }
+  else if (const std::string *str = field_ptr("gps-file"))
+    {
+      std::string path(*str);
+      if (shared_config().find_gps_file(path))
 	{
-	  std::string path(*str);
-	  if (shared_config().find_gps_file(path))
-	    {
-	      std::unique_ptr<gps::activity> a (new gps::activity);
-	      if (a->read_file(path.c_str()))
-		{
-		  using std::swap;
-		  swap(_gps_data, a);
-		}
-	    }
+	  return set_gps_track(gps_track_cache::shared_cache().find(path),
+			       path.c_str());
 	}
     }
 
-  return _gps_data.get();
+  return nullptr;
+}
+
+void
+activity::prefetch_gps_data(gps_track_cache::prefetch_group group) const
+{
+  if (_gps_data_reader != nullptr
+      || _gps_data.load(std::memory_order_acquire) != nullptr)
+    return;
+
+  if (const std::string *str = field_ptr("gps-file"))
+    {
+      std::string path(*str);
+      if (shared_config().find_gps_file(path))
+	gps_track_cache::shared_cache().prefetch(path, group);
+    }
+}
+
+/* Called with _gps_mutex held. PATH is the file TRACK was read from
+   (if any), returns TRACK. */
+
+const gps::activity *
+activity::set_gps_track(std::shared_ptr<const gps::activity> track,
+			const char *path) const
+{
+  if (track == nullptr)
+    return nullptr;
+
+  _gps_track = std::move(track);
+  _gps_path = path != nullptr ? path : "";
+  _gps_data.store(_gps_track.get(), std::memory_order_release);
+
+  return _gps_track.get();
+}
+
+/* Returns the GPS file's summary values, without parsing the file if
+   the summary cache has a current copy of them. */
+
+const gps::activity *
+activity::gps_summary() const
+{
+  if (_gps_data_reader != nullptr
+      || !shared_config().use_gps_summary_cache())
+    return gps_data();
+
+  if (const gps::activity *a = _gps_data.load(std::memory_order_acquire))
+    return a;
+  if (const gps::activity *a = _gps_summary.load(std::memory_order_acquire))
+    return a;
+
+  std::lock_guard<std::mutex> lock(_gps_mutex);
+
+  if (const gps::activity *a = _gps_data.load(std::memory_order_relaxed))
+    return a;
+  if (const gps::activity *a = _gps_summary.load(std::memory_order_relaxed))
+    return a;
+
+  const std::string *str = field_ptr("gps-file");
+  if (str == nullptr)
+    return nullptr;
+
+  std::string path(*str);
+  if (!shared_config().find_gps_file(path))
+    return nullptr;
+
+  gps_summary_cache &cache = gps_summary_cache::shared_cache();
+
+  std::unique_ptr<gps::activity> a (new gps::activity);
+
+  if (cache.lookup(path, *a))
+    {
+      _gps_summary.store(a.get(), std::memory_order_release);
+      return a.release();
+    }
+
+  if (const gps::activity *data = set_gps_track(
+	gps_track_cache::shared_cache().find(path), path.c_str()))
+    {
+      cache.update(path, *data);
+      return data;
+    }
+
+  return nullptr;
 }
 
 void
 activity::invalidate_gps_data()
 {
-  _gps_data.reset();
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::lock_guard<std::mutex> gps_lock(_gps_mutex);
+
+  // Later reads should see any changes to the file.
+
+  if (!_gps_path.empty())
+    gps_track_cache::shared_cache().remove(_gps_path);
+
+  _gps_data.store(nullptr, std::memory_order_relaxed);
+  _gps_track.reset();
+  _gps_path.clear();
+
+  delete _gps_summary.exchange(nullptr, std::memory_order_relaxed);
 
-  _invalid_groups |= _gps_dependent_groups;
+  _invalid_groups.fetch_or(_gps_dependent_groups, std::memory_order_relaxed);
   _gps_dependent_groups = 0;
 }
 
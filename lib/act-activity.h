@@ -29,15 +29,24 @@
 
 #include "act-types.h"
 #include "act-gps-activity.h"
+#include "act-gps-track-cache.h"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 
 namespace act {
 
+/* The accessors of a const activity may be called from several
+   threads at once, values are parsed (and the GPS file read) by the
+   first thread that needs them. Anything that modifies the activity
+   or its storage must not overlap with other calls. */
+
 class activity : public uncopyable
 {
 public:
   activity(activity_storage_ref storage);
+  ~activity();
 
   activity_storage_ref storage();
   const_activity_storage_ref storage() const;
@@ -79,6 +88,13 @@ public:
 
   const gps::activity *gps_data() const;
 
+  // Starts reading the GPS file on a background thread, so that a
+  // later gps_data() call only waits if it hasn't finished. Does
+  // nothing if the data is already loaded or comes from a
+  // gps_data_reader. GROUP is passed to gps_track_cache::prefetch().
+
+  void prefetch_gps_data(gps_track_cache::prefetch_group group = 0) const;
+
   void invalidate_gps_data();
 
   time_t date() const;
@@ -148,7 +164,17 @@ private:
   activity_storage_ref _storage;
 
   const gps_data_reader *_gps_data_reader;
-  mutable std::unique_ptr<gps::activity> _gps_data;
+
+  // Published once read, _gps_mutex serializes the reading.
+  // _gps_track owns _gps_data, and unless it came from
+  // _gps_data_reader is shared with gps_track_cache, keyed by
+  // _gps_path.
+
+  mutable std::mutex _gps_mutex;
+  mutable std::shared_ptr<const gps::activity> _gps_track;
+  mutable std::string _gps_path;
+  mutable std::atomic<const gps::activity *> _gps_data;
+  mutable std::atomic<gps::activity *> _gps_summary;
 
   // Split the properties into groups, helps avoid parsing the GPS
   // file until we really need it.
@@ -215,12 +241,27 @@ private:
   mutable std::vector<std::string> _weather;
   mutable std::vector<std::string> _keywords;
 
-  mutable unsigned int _invalid_groups;
+  // Groups are computed while holding _mutex, and their bits cleared
+  // from _invalid_groups once the values may be read. _seed is the
+  // storage seed the values were computed from.
+
+  mutable std::mutex _mutex;
+  mutable std::atomic<unsigned int> _invalid_groups;
   mutable unsigned int _gps_dependent_groups;
-  mutable uint32_t _seed;
+  mutable std::atomic<uint32_t> _seed;
 
   void validate_cached_values(unsigned int groups) const;
 
+  typedef bool (*field_parser)(const std::string &str, double *value_ptr,
+    unit_type *unit_ptr);
+
+  bool parse_field(field_id id, double *value_ptr, unit_type *unit_ptr,
+    field_parser parse) const;
+
+  const gps::activity *set_gps_track(
+    std::shared_ptr<const gps::activity> track, const char *path) const;
+  const gps::activity *gps_summary() const;
+
   void print_expansion(FILE *fh, const char *name, const char *arg,
     int field_width) const;
   void print_field(FILE *fh, const char *name, const char *arg) const;
@@ -253,7 +294,7 @@ inline void
 activity::increment_seed()
 {
   _storage->increment_seed();
-  _invalid_groups |= group_all;
+  _invalid_groups.fetch_or(group_all, std::memory_order_relaxed);
 }
 
 inline const std::string &
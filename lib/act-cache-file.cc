@@ -0,0 +1,134 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2026 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#include "act-cache-file.h"
+
+#include "act-config.h"
+#include "act-util.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_BYTE_ORDER 0x01020304
+
+namespace act {
+namespace cache_file {
+
+namespace {
+
+uint32_t
+checksum(const char *ptr, size_t size)
+{
+  // FNV-1a
+
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < size; i++)
+    h = (h ^ (uint8_t)ptr[i]) * 16777619U;
+  return h;
+}
+
+} // anonymous namespace
+
+bool
+check_header(const char *data, size_t size, const char *magic,
+	     uint32_t version, const char *&payload, size_t &payload_size,
+	     uint32_t &record_count)
+{
+  if (data == nullptr || size < sizeof(header))
+    return false;
+
+  header h;
+  memcpy(&h, data, sizeof(h));
+
+  if (memcmp(h.magic, magic, sizeof(h.magic)) != 0
+      || h.version != version
+      || h.byte_order != CACHE_BYTE_ORDER)
+    return false;
+
+  payload = data + sizeof(h);
+  payload_size = size - sizeof(h);
+
+  if (checksum(payload, payload_size) != h.checksum)
+    return false;
+
+  record_count = h.record_count;
+  return true;
+}
+
+void
+begin(std::string &buf, const char *magic, uint32_t version)
+{
+  header h;
+  memcpy(h.magic, magic, sizeof(h.magic));
+  h.version = version;
+  h.byte_order = CACHE_BYTE_ORDER;
+  h.record_count = 0;
+  h.checksum = 0;
+
+  buf.clear();
+  append(buf, h);
+}
+
+bool
+write(const char *path, std::string &buf, uint32_t record_count)
+{
+  header h;
+  memcpy(&h, buf.data(), sizeof(h));
+  h.record_count = record_count;
+  h.checksum = checksum(buf.data() + sizeof(h), buf.size() - sizeof(h));
+  memcpy(&buf[0], &h, sizeof(h));
+
+  std::string tmp_path, dest_path;
+
+  {
+    FILE_ptr fh(open_replacement_file(path, tmp_path, dest_path));
+    if (!fh)
+      return false;
+
+    if (fwrite(buf.data(), 1, buf.size(), fh.get()) != buf.size()
+	|| fflush(fh.get()) != 0)
+      {
+	unlink(tmp_path.c_str());
+	return false;
+      }
+  }
+
+  if ((shared_config().sync_writes() && !sync_path(tmp_path.c_str()))
+      || rename(tmp_path.c_str(), dest_path.c_str()) != 0)
+    {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+
+  return true;
+}
+
+int64_t
+racy_mtime()
+{
+  return ((int64_t)time(nullptr) - 1) * 1000000000;
+}
+
+} // namespace cache_file
+} // namespace act
@@ -0,0 +1,158 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2026 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#ifndef ACT_CACHE_FILE_H
+#define ACT_CACHE_FILE_H
+
+#include "act-base.h"
+
+#include <string>
+
+#include <string.h>
+
+namespace act {
+namespace cache_file {
+
+/* The binary cache files kept in the activity directory (see
+   database_cache and gps_summary_cache) share this layout, all
+   integers in native byte order:
+
+	char magic[8];
+	uint32_t version, byte_order, record_count, checksum;
+	RECORD records[record_count];
+
+   The records are defined by each cache, using STRING (a uint32_t
+   length followed by that many bytes) and fixed-size values. The
+   checksum covers everything after the header. */
+
+struct header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t record_count;
+  uint32_t checksum;
+};
+
+// Checks that the SIZE bytes at DATA start with a valid header with
+// MAGIC and VERSION, and that the records match its checksum. Sets
+// PAYLOAD and PAYLOAD_SIZE to the records and RECORD_COUNT to their
+// number.
+
+bool check_header(const char *data, size_t size, const char *magic,
+  uint32_t version, const char *&payload, size_t &payload_size,
+  uint32_t &record_count);
+
+// Clears BUF and appends a header with MAGIC and VERSION, its count
+// and checksum are filled in by write().
+
+void begin(std::string &buf, const char *magic, uint32_t version);
+
+// Completes the header of BUF for RECORD_COUNT records and replaces
+// the file PATH with it, via a uniquely named temporary file (see
+// open_replacement_file()).
+
+bool write(const char *path, std::string &buf, uint32_t record_count);
+
+// A file modified within a second of the cache being written may be
+// modified again without its times changing on filesystems with
+// coarse timestamps. Records of files whose mtime (in nanoseconds) is
+// at least this should be written with an mtime of -1, so they won't
+// be trusted when next read.
+
+int64_t racy_mtime();
+
+class reader
+{
+  const char *_ptr;
+  const char *_end;
+
+public:
+  reader(const char *ptr, size_t size) : _ptr(ptr), _end(ptr + size) {}
+
+  template<typename T> bool read(T &value)
+    {
+      if ((size_t)(_end - _ptr) < sizeof(T))
+	return false;
+      memcpy(&value, _ptr, sizeof(T));
+      _ptr += sizeof(T);
+      return true;
+    }
+
+  bool read_string(const char *&str, size_t &len)
+    {
+      uint32_t n;
+      if (!read(n) || (size_t)(_end - _ptr) < n)
+	return false;
+      str = _ptr;
+      len = n;
+      _ptr += n;
+      return true;
+    }
+
+  bool read_string(std::string &str)
+    {
+      const char *ptr;
+      size_t len;
+      if (!read_string(ptr, len))
+	return false;
+      str.assign(ptr, len);
+      return true;
+    }
+
+  bool skip(size_t n)
+    {
+      if ((size_t)(_end - _ptr) < n)
+	return false;
+      _ptr += n;
+      return true;
+    }
+
+  const char *ptr() const {return _ptr;}
+  bool at_end() const {return _ptr == _end;}
+};
+
+template<typename T> inline void
+append(std::string &buf, const T &value)
+{
+  buf.append((const char *)&value, sizeof(T));
+}
+
+inline void
+append_string(std::string &buf, const char *str, size_t len)
+{
+  append(buf, (uint32_t)len);
+  buf.append(str, len);
+}
+
+inline void
+append_string(std::string &buf, const std::string &str)
+{
+  append_string(buf, str.c_str(), str.size());
+}
+
+} // namespace cache_file
+} // namespace act
+
+#endif /* ACT_CACHE_FILE_H */
@@ -56,6 +56,14 @@ config::config()
   _vdot(0),
   _min_running_speed(2),  // 2 m/s ~ 13.4 min/mi
   _max_running_speed(7),  // 7 m/s ~ 3.8 min/mi
+  _use_database_cache(true),
+  _reload_threads(1),
+  _query_threads(1),
+  _use_grep_index(true),
+  _use_database_arena(true),
+  _sync_writes(false),
+  _use_gps_summary_cache(true),
+  _gps_track_cache_size(64),
   _silent(false),
   _verbose(false)
 {
@@ -118,6 +126,30 @@ config::config()
   if (const char *opt = getenv("ACT_VDOT"))
     _vdot = atof(opt);
 
+  if (const char *opt = getenv("ACT_DATABASE_CACHE"))
+    _use_database_cache = atoi(opt) != 0;
+
+  if (const char *opt = getenv("ACT_RELOAD_THREADS"))
+    _reload_threads = atoi(opt);
+
+  if (const char *opt = getenv("ACT_QUERY_THREADS"))
+    _query_threads = atoi(opt);
+
+  if (const char *opt = getenv("ACT_GREP_INDEX"))
+    _use_grep_index = atoi(opt) != 0;
+
+  if (const char *opt = getenv("ACT_DATABASE_ARENA"))
+    _use_database_arena = atoi(opt) != 0;
+
+  if (const char *opt = getenv("ACT_SYNC_WRITES"))
+    _sync_writes = atoi(opt) != 0;
+
+  if (const char *opt = getenv("ACT_GPS_SUMMARY_CACHE"))
+    _use_gps_summary_cache = atoi(opt) != 0;
+
+  if (const char *opt = getenv("ACT_GPS_TRACK_CACHE_SIZE"))
+    _gps_track_cache_size = atoi(opt);
+
   if (const char *opt = getenv("ACT_SILENT"))
     _silent = atoi(opt) != 0;
 
@@ -222,6 +254,22 @@ config::read_config_file(const char *path)
 	    tilde_expand_file_name(_gps_file_dir, value);
 	  else if (strcmp(name, "gps-file-path") == 0)
 	    append_gps_file_path(value, true);
+	  else if (strcmp(name, "database-cache") == 0)
+	    _use_database_cache = parse_boolean(value);
+	  else if (strcmp(name, "reload-threads") == 0)
+	    _reload_threads = atoi(value);
+	  else if (strcmp(name, "query-threads") == 0)
+	    _query_threads = atoi(value);
+	  else if (strcmp(name, "grep-index") == 0)
+	    _use_grep_index = parse_boolean(value);
+	  else if (strcmp(name, "database-arena") == 0)
+	    _use_database_arena = parse_boolean(value);
+	  else if (strcmp(name, "sync-writes") == 0)
+	    _sync_writes = parse_boolean(value);
+	  else if (strcmp(name, "gps-summary-cache") == 0)
+	    _use_gps_summary_cache = parse_boolean(value);
+	  else if (strcmp(name, "gps-track-cache-size") == 0)
+	    _gps_track_cache_size = atoi(value);
 	}
       else if (strcmp(section.c_str(), "units") == 0)
 	{
@@ -271,6 +319,15 @@ config::read_config_file(const char *path)
     }
 }
 
+bool
+config::parse_boolean(const char *value)
+{
+  if (isdigit_l(value[0], nullptr))
+    return atoi(value) != 0;
+  else
+    return strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0;
+}
+
 void
 config::set_start_of_week(const char *value)
 {
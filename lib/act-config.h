@@ -59,6 +59,15 @@ class config
   double _min_running_speed;
   double _max_running_speed;
 
+  bool _use_database_cache;
+  int _reload_threads;
+  int _query_threads;
+  bool _use_grep_index;
+  bool _use_database_arena;
+  bool _sync_writes;
+  bool _use_gps_summary_cache;
+  int _gps_track_cache_size;
+
   bool _silent;
   bool _verbose;
 
@@ -92,6 +101,46 @@ public:
   double min_running_speed() const;
   double max_running_speed() const;
 
+  // true if the parsed contents of the activity directory should be
+  // cached on disk, see database_cache.
+
+  bool use_database_cache() const;
+
+  // number of threads used to parse activity files, zero means one
+  // per CPU.
+
+  int reload_threads() const;
+
+  // number of threads used to evaluate query terms, zero means one
+  // per CPU.
+
+  int query_threads() const;
+
+  // true if body searches should be narrowed by an index of the
+  // trigrams in each activity body, see trigram_index.
+
+  bool use_grep_index() const;
+
+  // true if reloading allocates activities from chunks of memory
+  // shared by many of them, rather than one at a time.
+
+  bool use_database_arena() const;
+
+  // true if modified activity files should be flushed to disk
+  // before replacing the old versions.
+
+  bool sync_writes() const;
+
+  // true if the totals and laps of GPS files should be cached on
+  // disk, see gps_summary_cache.
+
+  bool use_gps_summary_cache() const;
+
+  // megabytes of parsed GPS tracks kept in memory by
+  // gps_track_cache, zero disables the cache.
+
+  int gps_track_cache_size() const;
+
   bool silent() const;
   bool verbose() const;
 
@@ -106,6 +155,7 @@ private:
   static const char *getenv(const char *key);
 
   void read_config_file(const char *path);
+  static bool parse_boolean(const char *value);
   void set_start_of_week(const char *value);
   void append_gps_file_path(const char *path_str, bool tilde_expand);
 };
@@ -216,6 +266,54 @@ config::max_running_speed() const
   return _max_running_speed;
 }
 
+inline bool
+config::use_database_cache() const
+{
+  return _use_database_cache;
+}
+
+inline int
+config::reload_threads() const
+{
+  return _reload_threads;
+}
+
+inline int
+config::query_threads() const
+{
+  return _query_threads;
+}
+
+inline bool
+config::use_grep_index() const
+{
+  return _use_grep_index;
+}
+
+inline bool
+config::use_database_arena() const
+{
+  return _use_database_arena;
+}
+
+inline bool
+config::sync_writes() const
+{
+  return _sync_writes;
+}
+
+inline bool
+config::use_gps_summary_cache() const
+{
+  return _use_gps_summary_cache;
+}
+
+inline int
+config::gps_track_cache_size() const
+{
+  return _gps_track_cache_size;
+}
+
 inline bool
 config::silent() const
 {
@@ -0,0 +1,458 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2015 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#include "act-database-cache.h"
+
+#include "act-cache-file.h"
+#include "act-util.h"
+
+#include <unordered_set>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CACHE_FILE_NAME ".act-database-cache"
+#define CACHE_MAGIC "ACTCACHE"
+#define CACHE_VERSION 4
+#define CACHE_NO_TRIGRAMS 0xffffffffU
+
+namespace act {
+
+namespace {
+
+/* Each RECORD in the cache file (see act-cache-file.h) is:
+
+	uint32_t record_size;		-- excluding this word
+	STRING path;
+	int64_t mtime, ctime, size;	-- times in nanoseconds
+	uint64_t inode;
+	int64_t date;
+	uint32_t field_count;
+	STRING name, value;		-- repeated field_count times
+	int64_t body_offset;		-- -1 if unknown
+	uint32_t body_cached;
+	STRING body;			-- empty unless body_cached
+	uint32_t trigram_count;		-- CACHE_NO_TRIGRAMS if unknown
+	STRING trigrams;
+
+   The trigrams are the sorted body trigrams, each stored as the
+   difference from its predecessor in seven-bit groups, least
+   significant first, with the top bit set on all but the last. The
+   body is only stored if it had been read when the record was
+   written, otherwise it can be loaded from body_offset in the
+   activity file. Records with racy mtimes (see
+   cache_file::racy_mtime()) are written with an mtime of -1 and will
+   be reparsed on the next load. */
+
+using cache_file::reader;
+using cache_file::append;
+using cache_file::append_string;
+
+void
+append_trigrams(std::string &buf, const std::vector<uint32_t> &trigrams)
+{
+  std::string data;
+
+  uint32_t last = 0;
+  for (uint32_t t : trigrams)
+    {
+      uint32_t delta = t - last;
+      while (delta >= 0x80)
+	{
+	  data.push_back((char)(0x80 | (delta & 0x7f)));
+	  delta >>= 7;
+	}
+      data.push_back((char)delta);
+      last = t;
+    }
+
+  append(buf, (uint32_t)trigrams.size());
+  append_string(buf, data);
+}
+
+bool
+decode_trigrams(const char *ptr, size_t len, uint32_t count,
+		std::vector<uint32_t> &trigrams)
+{
+  trigrams.clear();
+  trigrams.reserve(count);
+
+  const char *end = ptr + len;
+  uint32_t last = 0;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+      uint32_t delta = 0;
+      int shift = 0;
+
+      while (1)
+	{
+	  if (ptr == end || shift > 28)
+	    return false;
+	  uint8_t c = *ptr++;
+	  delta |= (uint32_t)(c & 0x7f) << shift;
+	  shift += 7;
+	  if (!(c & 0x80))
+	    break;
+	}
+
+      last += delta;
+      trigrams.push_back(last);
+    }
+
+  return ptr == end;
+}
+
+} // anonymous namespace
+
+database_cache::database_cache(const char *dir)
+: _dir(dir),
+  _map_addr(nullptr),
+  _map_size(0),
+  _hit_count(0),
+  _changed(false)
+{
+  _file = _dir;
+  _file.push_back('/');
+  _file.append(CACHE_FILE_NAME);
+}
+
+database_cache::~database_cache()
+{
+  if (_map_addr != nullptr)
+    munmap(_map_addr, _map_size);
+}
+
+bool
+database_cache::load()
+{
+  // Anything we fail to load needs to be rewritten.
+
+  _changed = true;
+
+  int fd = open(_file.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0
+      || st.st_size < (off_t)sizeof(cache_file::header))
+    {
+      close(fd);
+      return false;
+    }
+
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (addr == MAP_FAILED)
+    return false;
+
+  _map_addr = addr;
+  _map_size = st.st_size;
+
+  const char *payload;
+  size_t payload_size;
+  uint32_t record_count;
+  if (!cache_file::check_header(static_cast<const char *>(addr), _map_size,
+				CACHE_MAGIC, CACHE_VERSION, payload,
+				payload_size, record_count))
+    return false;
+
+  reader in(payload, payload_size);
+
+  for (uint32_t i = 0; i < record_count; i++)
+    {
+      record rec;
+      if (!in.read_string(rec.data, rec.size))
+	break;
+
+      const char *path;
+      size_t path_len;
+      reader rec_in(rec.data, rec.size);
+      if (!rec_in.read_string(path, path_len))
+	break;
+
+      _records[std::string(path, path_len)] = rec;
+    }
+
+  if (_records.size() != record_count || !in.at_end())
+    {
+      _records.clear();
+      return false;
+    }
+
+  _changed = false;
+  return true;
+}
+
+const char *
+database_cache::relative_path(const char *path) const
+{
+  if (strncmp(path, _dir.c_str(), _dir.size()) == 0
+      && path[_dir.size()] == '/')
+    return path + _dir.size() + 1;
+  else
+    return path;
+}
+
+bool
+database_cache::read_record(const record &rec, file_identity &info,
+			    time_t &date, activity_storage *storage,
+			    record_body *body, std::vector<uint32_t> *trigrams)
+{
+  reader in(rec.data, rec.size);
+
+  const char *str;
+  size_t len;
+  if (!in.read_string(str, len))
+    return false;
+
+  int64_t date64;
+  if (!in.read(info.mtime) || !in.read(info.ctime)
+      || !in.read(info.size) || !in.read(info.inode)
+      || !in.read(date64))
+    return false;
+
+  date = (time_t)date64;
+
+  if (storage == nullptr && body == nullptr && trigrams == nullptr)
+    return true;
+
+  uint32_t field_count;
+  if (!in.read(field_count))
+    return false;
+
+  for (uint32_t i = 0; i < field_count; i++)
+    {
+      const char *name, *value;
+      size_t name_len, value_len;
+      if (!in.read_string(name, name_len)
+	  || !in.read_string(value, value_len))
+	return false;
+
+      if (storage != nullptr)
+	(*storage)[std::string(name, name_len)].assign(value, value_len);
+    }
+
+  int64_t body_offset;
+  uint32_t body_cached;
+  if (!in.read(body_offset) || !in.read(body_cached)
+      || !in.read_string(str, len))
+    return false;
+
+  if (body != nullptr)
+    {
+      body->offset = body_offset;
+      body->cached = body_cached != 0;
+      body->data = str;
+      body->size = len;
+    }
+
+  uint32_t trigram_count;
+  if (!in.read(trigram_count) || !in.read_string(str, len))
+    return false;
+
+  if (trigrams != nullptr)
+    {
+      if (trigram_count == CACHE_NO_TRIGRAMS
+	  || !decode_trigrams(str, len, trigram_count, *trigrams))
+	return false;
+    }
+
+  return in.at_end();
+}
+
+bool
+database_cache::lookup(const char *path, const struct stat &st,
+		       time_t &date, activity_storage &storage,
+		       bool with_body) const
+{
+  auto it = _records.find(relative_path(path));
+  if (it == _records.end())
+    return false;
+
+  file_identity info;
+  if (!read_record(it->second, info, date, nullptr)
+      || info != file_identity(st))
+    return false;
+
+  record_body body;
+  if (!read_record(it->second, info, date, &storage, &body))
+    return false;
+
+  if (body.cached && (with_body || body.offset < 0))
+    {
+      storage.body().assign(body.data, body.size);
+      storage.set_body_offset(body.offset);
+    }
+  else if (!with_body && body.offset >= 0)
+    storage.defer_body(path, info, body.offset);
+  else
+    return false;
+
+  storage.update_value_handles();
+  storage.increment_seed();
+
+  return true;
+}
+
+bool
+database_cache::lookup_trigrams(const char *path,
+				std::vector<uint32_t> &trigrams) const
+{
+  auto it = _records.find(relative_path(path));
+  if (it == _records.end())
+    return false;
+
+  file_identity info;
+  time_t date;
+  return read_record(it->second, info, date, nullptr, nullptr, &trigrams);
+}
+
+void
+database_cache::update(const char *path, const struct stat &st,
+		       time_t date, const const_activity_storage_ref &storage,
+		       bool hit, const std::vector<uint32_t> *trigrams)
+{
+  std::lock_guard<std::mutex> lock(_pending_mutex);
+
+  _pending.resize(_pending.size() + 1);
+  pending_record &rec = _pending.back();
+
+  rec.path = relative_path(path);
+  rec.info = file_identity(st);
+  rec.date = date;
+  rec.storage = storage;
+  rec.has_trigrams = trigrams != nullptr;
+  if (trigrams != nullptr)
+    rec.trigrams = *trigrams;
+
+  if (hit)
+    _hit_count++;
+  else
+    _changed = true;
+}
+
+bool
+database_cache::save(bool complete)
+{
+  if (!_changed && (_hit_count == _records.size() || !complete))
+    return true;
+
+  std::string buf;
+  cache_file::begin(buf, CACHE_MAGIC, CACHE_VERSION);
+
+  uint32_t record_count = (uint32_t)_pending.size();
+
+  std::string rec_buf;
+
+  int64_t racy_mtime = cache_file::racy_mtime();
+
+  for (const auto &it : _pending)
+    {
+      rec_buf.clear();
+
+      append_string(rec_buf, it.path);
+      append(rec_buf, it.info.mtime < racy_mtime ? it.info.mtime : -1);
+      append(rec_buf, it.info.ctime);
+      append(rec_buf, it.info.size);
+      append(rec_buf, it.info.inode);
+      append(rec_buf, (int64_t)it.date);
+
+      append(rec_buf, (uint32_t)it.storage->field_count());
+      for (const auto &field : *it.storage)
+	{
+	  append_string(rec_buf, field.first);
+	  append_string(rec_buf, field.second);
+	}
+
+      append(rec_buf, it.storage->body_offset());
+
+      if (it.storage->body_loaded())
+	{
+	  append(rec_buf, (uint32_t)1);
+	  append_string(rec_buf, it.storage->body());
+	}
+      else
+	{
+	  // Keep the body from the old record if the file hasn't
+	  // changed, rather than reading it now.
+
+	  record_body body;
+	  file_identity info;
+	  time_t date;
+	  auto old = _records.find(it.path);
+	  if (old != _records.end()
+	      && read_record(old->second, info, date, nullptr, &body)
+	      && info == it.info && body.cached)
+	    {
+	      append(rec_buf, (uint32_t)1);
+	      append_string(rec_buf, body.data, body.size);
+	    }
+	  else
+	    {
+	      append(rec_buf, (uint32_t)0);
+	      append_string(rec_buf, "", 0);
+	    }
+	}
+
+      if (it.has_trigrams)
+	append_trigrams(rec_buf, it.trigrams);
+      else
+	{
+	  append(rec_buf, (uint32_t)CACHE_NO_TRIGRAMS);
+	  append_string(rec_buf, "", 0);
+	}
+
+      append_string(buf, rec_buf);
+    }
+
+  if (!complete)
+    {
+      std::unordered_set<std::string> visited;
+      for (const auto &it : _pending)
+	visited.insert(it.path);
+
+      for (const auto &it : _records)
+	{
+	  if (visited.find(it.first) == visited.end())
+	    {
+	      append_string(buf, it.second.data, it.second.size);
+	      record_count++;
+	    }
+	}
+    }
+
+  if (!cache_file::write(_file.c_str(), buf, record_count))
+    return false;
+
+  _changed = false;
+  return true;
+}
+
+} // namespace act
@@ -0,0 +1,136 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2015 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#ifndef ACT_DATABASE_CACHE_H
+#define ACT_DATABASE_CACHE_H
+
+#include "act-activity-storage.h"
+#include "act-util.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <time.h>
+
+namespace act {
+
+/* On-disk snapshot of the parsed contents of an activity directory,
+   so that reloading the database only needs to parse the files that
+   were added or modified since the snapshot was written. Records are
+   keyed by the path relative to the directory, and are only used if
+   the file's mtime, ctime, size and inode still match. */
+
+class database_cache : public uncopyable
+{
+public:
+  explicit database_cache(const char *dir);
+  ~database_cache();
+
+  // Maps the cache file into memory. Returns false if it's missing
+  // or unusable, in which case the cache starts out empty.
+
+  bool load();
+
+  // Fills the empty STORAGE with the cached contents of PATH.
+  // Returns false if there's no valid record for the file described
+  // by ST, in which case STORAGE may have been partially filled. If
+  // WITH_BODY is false the storage's body is left to be read from
+  // the file when needed, otherwise records without a cached body
+  // are treated as missing.
+
+  bool lookup(const char *path, const struct stat &st, time_t &date,
+    activity_storage &storage, bool with_body = true) const;
+
+  // Sets TRIGRAMS to the body trigrams stored with PATH's record, see
+  // trigram_index. Returns false if the record has none.
+
+  bool lookup_trigrams(const char *path,
+    std::vector<uint32_t> &trigrams) const;
+
+  // Adds PATH to the set of records written by save(). HIT should be
+  // true if the storage came from lookup(). TRIGRAMS, if non-null,
+  // are the trigrams of STORAGE's body. These functions may be
+  // called from multiple threads.
+
+  void update(const char *path, const struct stat &st, time_t date,
+    const const_activity_storage_ref &storage, bool hit,
+    const std::vector<uint32_t> *trigrams = nullptr);
+
+  // Rewrites the cache file if its contents would change. If
+  // COMPLETE is false not every file was visited, so records that
+  // weren't passed to update() are copied from the old file.
+
+  bool save(bool complete = true);
+
+private:
+  struct record
+    {
+      const char *data;
+      size_t size;
+    };
+
+  struct record_body
+    {
+      int64_t offset;
+      bool cached;
+      const char *data;
+      size_t size;
+    };
+
+  struct pending_record
+    {
+      std::string path;
+      file_identity info;
+      time_t date;
+      const_activity_storage_ref storage;
+      bool has_trigrams;
+      std::vector<uint32_t> trigrams;
+    };
+
+  std::string _dir;
+  std::string _file;
+
+  void *_map_addr;
+  size_t _map_size;
+
+  std::unordered_map<std::string, record> _records;
+  std::vector<pending_record> _pending;
+  std::mutex _pending_mutex;
+
+  size_t _hit_count;
+  bool _changed;
+
+  const char *relative_path(const char *path) const;
+
+  static bool read_record(const record &rec, file_identity &info,
+    time_t &date, activity_storage *storage, record_body *body = nullptr,
+    std::vector<uint32_t> *trigrams = nullptr);
+};
+
+} // namespace act
+
+#endif /* ACT_DATABASE_CACHE_H */
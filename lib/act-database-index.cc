@@ -0,0 +1,746 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2015 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#include "act-database-index.h"
+
+#include "act-format.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <string.h>
+#include <xlocale.h>
+
+namespace act {
+
+namespace {
+
+/* Sets NEW_ROWS[I] to the index of row I of COUNT rows once ROWS are
+   removed, or SIZE_MAX if it's one of them. */
+
+void
+removal_map(const std::vector<size_t> &rows, size_t count,
+	    std::vector<size_t> &new_rows)
+{
+  new_rows.resize(count);
+
+  auto it = rows.begin();
+  size_t next = 0;
+
+  for (size_t i = 0; i < count; i++)
+    {
+      if (it != rows.end() && *it == i)
+	{
+	  new_rows[i] = SIZE_MAX;
+	  ++it;
+	}
+      else
+	new_rows[i] = next++;
+    }
+}
+
+} // anonymous namespace
+
+bool
+keyword_index::indexed_field_p(field_id id)
+{
+  return field_slot(id) >= 0;
+}
+
+int
+keyword_index::field_slot(field_id id)
+{
+  switch (id)
+    {
+    case field_id::equipment:
+      return 0;
+    case field_id::weather:
+      return 1;
+    case field_id::keywords:
+      return 2;
+    default:
+      return -1;
+    }
+}
+
+std::string
+keyword_index::fold_case(const std::string &str)
+{
+  std::string ret(str);
+
+  for (auto &c : ret)
+    c = tolower_l(c, nullptr);
+
+  return ret;
+}
+
+void
+keyword_index::clear()
+{
+  _rows.clear();
+
+  for (auto &map : _postings)
+    map.clear();
+}
+
+void
+keyword_index::set_row_count(size_t count)
+{
+  for (size_t i = count; i < _rows.size(); i++)
+    remove_postings(i);
+
+  _rows.resize(count);
+}
+
+void
+keyword_index::insert_row(size_t idx)
+{
+  for (auto &map : _postings)
+    {
+      for (auto &it : map)
+	{
+	  std::vector<size_t> &rows = it.second;
+	  for (auto r = std::lower_bound(rows.begin(), rows.end(), idx);
+	       r != rows.end(); r++)
+	    {
+	      (*r)++;
+	    }
+	}
+    }
+
+  _rows.insert(_rows.begin() + idx, row());
+}
+
+void
+keyword_index::remove_row(size_t idx)
+{
+  remove_postings(idx);
+
+  for (auto &map : _postings)
+    {
+      for (auto &it : map)
+	{
+	  std::vector<size_t> &rows = it.second;
+	  for (auto r = std::lower_bound(rows.begin(), rows.end(), idx);
+	       r != rows.end(); r++)
+	    {
+	      (*r)--;
+	    }
+	}
+    }
+
+  _rows.erase(_rows.begin() + idx);
+}
+
+void
+keyword_index::remove_rows(const std::vector<size_t> &rows)
+{
+  for (size_t idx : rows)
+    remove_postings(idx);
+
+  std::vector<size_t> new_rows;
+  removal_map(rows, _rows.size(), new_rows);
+
+  size_t count = 0;
+  for (size_t i = 0; i < _rows.size(); i++)
+    {
+      if (new_rows[i] != SIZE_MAX)
+	{
+	  using std::swap;
+	  swap(_rows[count++], _rows[i]);
+	}
+    }
+
+  _rows.resize(count);
+
+  // Only remaining rows are posted, and the mapping is increasing.
+
+  for (auto &map : _postings)
+    {
+      for (auto &it : map)
+	{
+	  for (auto &r : it.second)
+	    r = new_rows[r];
+	}
+    }
+}
+
+void
+keyword_index::remap_rows(const std::vector<size_t> &new_rows, size_t count)
+{
+  std::vector<row> rows(count);
+
+  for (size_t i = 0; i < _rows.size(); i++)
+    {
+      using std::swap;
+      swap(rows[new_rows[i]], _rows[i]);
+    }
+
+  using std::swap;
+  swap(_rows, rows);
+
+  // The mapping is increasing, so posting lists stay sorted.
+
+  for (auto &map : _postings)
+    {
+      for (auto &it : map)
+	{
+	  for (auto &r : it.second)
+	    r = new_rows[r];
+	}
+    }
+}
+
+void
+keyword_index::update_row(size_t idx, const activity_storage_ref &storage)
+{
+  row &r = _rows[idx];
+
+  if (r.storage == storage && r.seed == storage->seed())
+    return;
+
+  remove_postings(idx);
+
+  r.storage = storage;
+  r.seed = storage->seed();
+
+  static const field_id fields[field_count]
+    = {field_id::equipment, field_id::weather, field_id::keywords};
+
+  for (int i = 0; i < field_count; i++)
+    {
+      r.keywords[i].clear();
+      if (const std::string *str
+	  = storage->field_ptr(canonical_field_name(fields[i])))
+	{
+	  parse_keywords(*str, &r.keywords[i]);
+	}
+    }
+
+  add_postings(idx);
+}
+
+void
+keyword_index::add_postings(size_t idx)
+{
+  const row &r = _rows[idx];
+
+  for (int i = 0; i < field_count; i++)
+    {
+      for (const auto &key : r.keywords[i])
+	{
+	  std::vector<size_t> &rows = _postings[i][fold_case(key)];
+
+	  // the same keyword may appear more than once in a field.
+
+	  auto it = std::lower_bound(rows.begin(), rows.end(), idx);
+	  if (it == rows.end() || *it != idx)
+	    rows.insert(it, idx);
+	}
+    }
+}
+
+void
+keyword_index::remove_postings(size_t idx)
+{
+  const row &r = _rows[idx];
+
+  for (int i = 0; i < field_count; i++)
+    {
+      for (const auto &key : r.keywords[i])
+	{
+	  auto map_it = _postings[i].find(fold_case(key));
+	  if (map_it == _postings[i].end())
+	    continue;
+
+	  std::vector<size_t> &rows = map_it->second;
+	  auto it = std::lower_bound(rows.begin(), rows.end(), idx);
+	  if (it != rows.end() && *it == idx)
+	    rows.erase(it);
+
+	  if (rows.size() == 0)
+	    _postings[i].erase(map_it);
+	}
+    }
+}
+
+const std::vector<size_t> *
+keyword_index::find(field_id id, const std::string &key) const
+{
+  int slot = field_slot(id);
+  if (slot < 0)
+    return nullptr;
+
+  auto it = _postings[slot].find(fold_case(key));
+  if (it == _postings[slot].end())
+    return nullptr;
+
+  return &it->second;
+}
+
+bool
+keyword_index::row_contains(size_t idx, field_id id,
+			    const std::string &key) const
+{
+  if (const std::vector<size_t> *rows = find(id, key))
+    return std::binary_search(rows->begin(), rows->end(), idx);
+  else
+    return false;
+}
+
+const std::vector<std::string> &
+keyword_index::row_keywords(size_t idx, field_id id) const
+{
+  return _rows[idx].keywords[field_slot(id)];
+}
+
+namespace {
+
+inline uint32_t
+fold_byte(char c)
+{
+  return (uint8_t)tolower_l(c, nullptr);
+}
+
+inline uint32_t
+make_trigram(uint32_t a, uint32_t b, uint32_t c)
+{
+  return (a << 16) | (b << 8) | c;
+}
+
+void
+sort_trigrams(trigram_index::trigram_set &set)
+{
+  std::sort(set.begin(), set.end());
+  set.erase(std::unique(set.begin(), set.end()), set.end());
+}
+
+// Returns the index after the bracket expression starting at RE[IDX].
+
+size_t
+skip_bracket_expression(const std::string &re, size_t idx)
+{
+  idx++;
+
+  if (idx < re.size() && re[idx] == '^')
+    idx++;
+  if (idx < re.size() && re[idx] == ']')
+    idx++;
+
+  while (idx < re.size() && re[idx] != ']')
+    {
+      if (re[idx] == '['
+	  && idx + 1 < re.size()
+	  && (re[idx+1] == ':' || re[idx+1] == '.' || re[idx+1] == '='))
+	{
+	  char delim = re[idx+1];
+	  idx += 2;
+	  while (idx + 1 < re.size()
+		 && !(re[idx] == delim && re[idx+1] == ']'))
+	    idx++;
+	  idx += 2;
+	}
+      else
+	idx++;
+    }
+
+  return idx + 1;
+}
+
+} // anonymous namespace
+
+void
+trigram_index::string_trigrams(const std::string &str, trigram_set &set)
+{
+  set.clear();
+
+  if (str.size() < 3)
+    return;
+
+  set.reserve(str.size() - 2);
+
+  uint32_t a = fold_byte(str[0]);
+  uint32_t b = fold_byte(str[1]);
+
+  for (size_t i = 2; i < str.size(); i++)
+    {
+      uint32_t c = fold_byte(str[i]);
+      set.push_back(make_trigram(a, b, c));
+      a = b, b = c;
+    }
+
+  sort_trigrams(set);
+}
+
+bool
+trigram_index::regexp_trigrams(const std::string &re, trigram_set &set)
+{
+  /* Collects the runs of ordinary characters outside any
+     parenthesized group or bracket expression, dropping characters
+     made optional by a following '*', '?' or interval. Anything not
+     understood ends the current run, which can only lose trigrams,
+     never add one the regexp doesn't require. Top-level alternation
+     means nothing is required. Only ASCII is used, as REG_ICASE may
+     fold other characters differently to tolower(). */
+
+  set.clear();
+
+  std::string run;
+
+  auto flush_run = [&] () {
+    for (size_t i = 2; i < run.size(); i++)
+      set.push_back(make_trigram(run[i-2], run[i-1], run[i]));
+    run.clear();
+  };
+
+  // regcomp() stops at any NUL.
+
+  size_t end = strlen(re.c_str());
+
+  size_t idx = 0;
+  int depth = 0;
+
+  while (idx < end)
+    {
+      char c = re[idx];
+
+      if (depth > 0)
+	{
+	  if (c == '(')
+	    depth++, idx++;
+	  else if (c == ')')
+	    depth--, idx++;
+	  else if (c == '[')
+	    idx = skip_bracket_expression(re, idx);
+	  else if (c == '\\')
+	    idx += 2;
+	  else
+	    idx++;
+	  continue;
+	}
+
+      switch (c)
+	{
+	case '|':
+	  set.clear();
+	  return false;
+
+	case '(':
+	  flush_run();
+	  depth = 1;
+	  idx++;
+	  break;
+
+	case '[':
+	  flush_run();
+	  idx = skip_bracket_expression(re, idx);
+	  break;
+
+	case '*':
+	case '?':
+	case '{':
+	  if (run.size() != 0)
+	    run.erase(run.size() - 1);
+	  flush_run();
+	  if (c == '{')
+	    {
+	      while (idx < end && re[idx] != '}')
+		idx++;
+	    }
+	  idx++;
+	  break;
+
+	case '\\':
+	  if (idx + 1 < end && strchr(".[]()*+?{}|^$\\", re[idx+1]))
+	    run.push_back(fold_byte(re[idx+1]));
+	  else
+	    flush_run();
+	  idx += 2;
+	  break;
+
+	default:
+	  if ((uint8_t)c < 0x80 && !strchr(".^$+)]}", c))
+	    run.push_back(fold_byte(c));
+	  else
+	    flush_run();
+	  idx++;
+	}
+    }
+
+  flush_run();
+
+  if (depth != 0)
+    set.clear();
+
+  sort_trigrams(set);
+
+  return set.size() != 0;
+}
+
+trigram_index::trigram_index()
+: _postings_valid(false)
+{
+}
+
+void
+trigram_index::clear()
+{
+  _rows.clear();
+  _postings.clear();
+  _postings_valid = false;
+}
+
+void
+trigram_index::set_row_count(size_t count)
+{
+  if (_postings_valid)
+    {
+      for (size_t i = count; i < _rows.size(); i++)
+	remove_postings(i);
+    }
+
+  _rows.resize(count);
+}
+
+void
+trigram_index::insert_row(size_t idx)
+{
+  if (_postings_valid)
+    {
+      for (auto &it : _postings)
+	{
+	  std::vector<size_t> &rows = it.second;
+	  for (auto r = std::lower_bound(rows.begin(), rows.end(), idx);
+	       r != rows.end(); r++)
+	    {
+	      (*r)++;
+	    }
+	}
+    }
+
+  _rows.insert(_rows.begin() + idx, row());
+}
+
+void
+trigram_index::remove_row(size_t idx)
+{
+  if (_postings_valid)
+    {
+      remove_postings(idx);
+
+      for (auto &it : _postings)
+	{
+	  std::vector<size_t> &rows = it.second;
+	  for (auto r = std::lower_bound(rows.begin(), rows.end(), idx);
+	       r != rows.end(); r++)
+	    {
+	      (*r)--;
+	    }
+	}
+    }
+
+  _rows.erase(_rows.begin() + idx);
+}
+
+void
+trigram_index::remove_rows(const std::vector<size_t> &rows)
+{
+  if (_postings_valid)
+    {
+      for (size_t idx : rows)
+	remove_postings(idx);
+    }
+
+  std::vector<size_t> new_rows;
+  removal_map(rows, _rows.size(), new_rows);
+
+  size_t count = 0;
+  for (size_t i = 0; i < _rows.size(); i++)
+    {
+      if (new_rows[i] != SIZE_MAX)
+	{
+	  using std::swap;
+	  swap(_rows[count++], _rows[i]);
+	}
+    }
+
+  _rows.resize(count);
+
+  if (_postings_valid)
+    {
+      for (auto &it : _postings)
+	{
+	  for (auto &r : it.second)
+	    r = new_rows[r];
+	}
+    }
+}
+
+void
+trigram_index::remap_rows(const std::vector<size_t> &new_rows, size_t count)
+{
+  std::vector<row> rows(count);
+
+  for (size_t i = 0; i < _rows.size(); i++)
+    {
+      using std::swap;
+      swap(rows[new_rows[i]], _rows[i]);
+    }
+
+  using std::swap;
+  swap(_rows, rows);
+
+  if (_postings_valid)
+    {
+      for (auto &it : _postings)
+	{
+	  for (auto &r : it.second)
+	    r = new_rows[r];
+	}
+    }
+}
+
+bool
+trigram_index::update_row(size_t idx, const activity_storage_ref &storage)
+{
+  row &r = _rows[idx];
+
+  if (r.storage == storage && r.seed == storage->seed())
+    return true;
+
+  if (!storage->body_loaded())
+    {
+      if (r.storage)
+	{
+	  if (_postings_valid)
+	    remove_postings(idx);
+	  r = row();
+	}
+      return false;
+    }
+
+  trigram_set set;
+  string_trigrams(storage->body(), set);
+
+  set_row(idx, storage, set);
+  return true;
+}
+
+void
+trigram_index::set_row(size_t idx, const activity_storage_ref &storage,
+		       const trigram_set &set)
+{
+  if (_postings_valid)
+    remove_postings(idx);
+
+  row &r = _rows[idx];
+
+  r.storage = storage;
+  r.seed = storage->seed();
+  r.trigrams = set;
+
+  if (_postings_valid)
+    add_postings(idx);
+}
+
+void
+trigram_index::add_postings(size_t idx)
+{
+  for (uint32_t t : _rows[idx].trigrams)
+    {
+      std::vector<size_t> &rows = _postings[t];
+      rows.insert(std::lower_bound(rows.begin(), rows.end(), idx), idx);
+    }
+}
+
+void
+trigram_index::remove_postings(size_t idx)
+{
+  for (uint32_t t : _rows[idx].trigrams)
+    {
+      auto map_it = _postings.find(t);
+      if (map_it == _postings.end())
+	continue;
+
+      std::vector<size_t> &rows = map_it->second;
+      auto it = std::lower_bound(rows.begin(), rows.end(), idx);
+      if (it != rows.end() && *it == idx)
+	rows.erase(it);
+
+      if (rows.size() == 0)
+	_postings.erase(map_it);
+    }
+}
+
+void
+trigram_index::find(const trigram_set &set, std::vector<size_t> &rows)
+{
+  if (!_postings_valid)
+    {
+      // rows are visited in order, so the lists stay sorted.
+
+      for (size_t i = 0; i < _rows.size(); i++)
+	{
+	  for (uint32_t t : _rows[i].trigrams)
+	    _postings[t].push_back(i);
+	}
+
+      _postings_valid = true;
+    }
+
+  rows.clear();
+
+  // Intersect the shortest lists first.
+
+  std::vector<const std::vector<size_t> *> lists;
+
+  for (uint32_t t : set)
+    {
+      auto it = _postings.find(t);
+      if (it == _postings.end())
+	return;
+      lists.push_back(&it->second);
+    }
+
+  if (lists.size() == 0)
+    return;
+
+  std::sort(lists.begin(), lists.end(),
+	    [] (const std::vector<size_t> *a, const std::vector<size_t> *b) {
+	      return a->size() < b->size();
+	    });
+
+  rows = *lists[0];
+
+  for (size_t i = 1; i < lists.size() && rows.size() != 0; i++)
+    {
+      std::vector<size_t> tem;
+      std::set_intersection(rows.begin(), rows.end(), lists[i]->begin(),
+			    lists[i]->end(), std::back_inserter(tem));
+      using std::swap;
+      swap(rows, tem);
+    }
+}
+
+} // namespace act
@@ -0,0 +1,194 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2015 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#ifndef ACT_DATABASE_INDEX_H
+#define ACT_DATABASE_INDEX_H
+
+#include "act-activity-storage.h"
+#include "act-types.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace act {
+
+/* Maps the case-folded keywords of the keyword-typed fields
+   (Equipment, Weather and Keywords) to the sorted list of rows whose
+   field contains them. Rows correspond to database items, each is
+   re-indexed when its storage or storage seed changes. */
+
+class keyword_index : public uncopyable
+{
+public:
+  static bool indexed_field_p(field_id id);
+
+  void clear();
+
+  size_t row_count() const;
+  void set_row_count(size_t count);
+
+  // Moves rows IDX and above up by one, leaving an empty row at IDX.
+
+  void insert_row(size_t idx);
+
+  // Removes row IDX, moving the rows above it down by one.
+
+  void remove_row(size_t idx);
+
+  // Removes ROWS (sorted, no duplicates) in one pass, moving the
+  // remaining rows down to fill the gaps.
+
+  void remove_rows(const std::vector<size_t> &rows);
+
+  // Moves each row I to NEW_ROWS[I], which must be increasing, in a
+  // table of COUNT rows. Rows not moved to are left empty.
+
+  void remap_rows(const std::vector<size_t> &new_rows, size_t count);
+
+  // Re-indexes row IDX unless it was last indexed from the same
+  // storage with the same seed.
+
+  void update_row(size_t idx, const activity_storage_ref &storage);
+
+  // Returns the rows whose field ID contains KEY, ignoring case, or
+  // null if there are none.
+
+  const std::vector<size_t> *find(field_id id, const std::string &key) const;
+
+  bool row_contains(size_t idx, field_id id, const std::string &key) const;
+
+  // The keywords of field ID in row IDX, as written in the file.
+
+  const std::vector<std::string> &row_keywords(size_t idx, field_id id) const;
+
+private:
+  enum {field_count = 3};
+
+  struct row
+    {
+      const_activity_storage_ref storage;
+      uint32_t seed;
+      std::vector<std::string> keywords[field_count];
+
+      row() : seed(0) {}
+    };
+
+  typedef std::unordered_map<std::string, std::vector<size_t>> posting_map;
+
+  std::vector<row> _rows;
+  posting_map _postings[field_count];
+
+  static int field_slot(field_id id);
+  static std::string fold_case(const std::string &str);
+
+  void add_postings(size_t idx);
+  void remove_postings(size_t idx);
+};
+
+/* Maps each three-byte sequence of the case-folded activity bodies
+   to the sorted list of rows containing it, so that body searches
+   only need to run the regexp over bodies containing every trigram
+   the regexp requires. Per-row trigrams are kept (and may be
+   supplied by the caller, e.g. from database_cache), the posting
+   lists are only built on first use. */
+
+class trigram_index : public uncopyable
+{
+public:
+  typedef std::vector<uint32_t> trigram_set;	// sorted, no duplicates
+
+  static void string_trigrams(const std::string &str, trigram_set &set);
+
+  // Sets SET to trigrams that any string matched by the extended
+  // regexp RE, compiled with REG_ICASE, must contain. Returns false
+  // if there aren't any.
+
+  static bool regexp_trigrams(const std::string &re, trigram_set &set);
+
+  trigram_index();
+
+  void clear();
+
+  size_t row_count() const;
+  void set_row_count(size_t count);
+  void insert_row(size_t idx);
+  void remove_row(size_t idx);
+
+  // See keyword_index::remove_rows() and remap_rows().
+
+  void remove_rows(const std::vector<size_t> &rows);
+
+  void remap_rows(const std::vector<size_t> &new_rows, size_t count);
+
+  // Re-indexes row IDX from the body of STORAGE unless it was last
+  // indexed from the same storage with the same seed. Deferred bodies
+  // aren't read, the row is left unindexed and false is returned.
+
+  bool update_row(size_t idx, const activity_storage_ref &storage);
+
+  // Sets row IDX to SET, the trigrams of STORAGE's current body.
+
+  void set_row(size_t idx, const activity_storage_ref &storage,
+    const trigram_set &set);
+
+  // Sets ROWS to the rows whose bodies contain every trigram in SET.
+
+  void find(const trigram_set &set, std::vector<size_t> &rows);
+
+private:
+  struct row
+    {
+      const_activity_storage_ref storage;
+      uint32_t seed;
+      trigram_set trigrams;
+
+      row() : seed(0) {}
+    };
+
+  std::vector<row> _rows;
+  std::unordered_map<uint32_t, std::vector<size_t>> _postings;
+  bool _postings_valid;
+
+  void add_postings(size_t idx);
+  void remove_postings(size_t idx);
+};
+
+// implementation details
+
+inline size_t
+keyword_index::row_count() const
+{
+  return _rows.size();
+}
+
+inline size_t
+trigram_index::row_count() const
+{
+  return _rows.size();
+}
+
+} // namespace act
+
+#endif /* ACT_DATABASE_INDEX_H */
@@ -0,0 +1,334 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2026 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+
+#include "act-database-watcher.h"
+
+#if defined(__linux__) && __linux__
+
+#include "act-util.h"
+
+#include <algorithm>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_EVENTS \
+  (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+   | IN_ONLYDIR)
+
+/* Events are coalesced until none arrive for COALESCE_MS, waiting at
+   most MAX_COALESCE_ROUNDS times. */
+
+#define COALESCE_MS 100
+#define MAX_COALESCE_ROUNDS 10
+
+namespace act {
+
+database_watcher::database_watcher(database &db, const char *dir)
+: _db(db),
+  _dir(dir),
+  _fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+  _overflowed(false)
+{
+  strip_trailing_slashes(_dir);
+
+  if (_fd >= 0)
+    add_watch(_dir, false);
+}
+
+database_watcher::~database_watcher()
+{
+  if (_fd >= 0)
+    close(_fd);
+}
+
+void
+database_watcher::add_observer(observer *obs)
+{
+  _observers.push_back(obs);
+}
+
+void
+database_watcher::remove_observer(observer *obs)
+{
+  _observers.erase(std::remove(_observers.begin(), _observers.end(), obs),
+		   _observers.end());
+}
+
+/* Watches DIR and its subdirectories. If SCAN is true their files are
+   also queued, as they may have been written before the watch
+   existed. */
+
+void
+database_watcher::add_watch(const std::string &dir, bool scan)
+{
+  int wd = inotify_add_watch(_fd, dir.c_str(), WATCH_EVENTS);
+  if (wd < 0)
+    return;
+
+  _watches[wd] = dir;
+
+  std::vector<std::string> subdirs, files;
+  list_directory(dir.c_str(), subdirs, files);
+
+  for (const auto &it : subdirs)
+    add_watch(it, scan);
+
+  if (scan)
+    _pending.insert(files.begin(), files.end());
+}
+
+/* Stops watching DIR and its subdirectories, and queues the items
+   that were read from them. */
+
+void
+database_watcher::remove_watches(const std::string &dir)
+{
+  std::string prefix(dir);
+  prefix.push_back('/');
+
+  for (auto it = _watches.begin(); it != _watches.end();)
+    {
+      if (it->second == dir
+	  || it->second.compare(0, prefix.size(), prefix) == 0)
+	{
+	  inotify_rm_watch(_fd, it->first);
+	  it = _watches.erase(it);
+	}
+      else
+	++it;
+    }
+
+  for (const auto &it : _db.items())
+    {
+      const char *path = it.storage()->path();
+      if (strncmp(path, prefix.c_str(), prefix.size()) == 0)
+	_pending.insert(path);
+    }
+}
+
+/* Reads the queued events, returns false if there weren't any. */
+
+bool
+database_watcher::read_events()
+{
+  alignas(struct inotify_event) char buf[16384];
+  bool ret = false;
+
+  while (1)
+    {
+      ssize_t len = read(_fd, buf, sizeof(buf));
+      if (len <= 0)
+	break;
+
+      ret = true;
+
+      for (ssize_t off = 0; off < len;)
+	{
+	  const struct inotify_event *ev
+	    = reinterpret_cast<const struct inotify_event *>(buf + off);
+	  off += sizeof(struct inotify_event) + ev->len;
+
+	  if (ev->mask & IN_Q_OVERFLOW)
+	    {
+	      _overflowed = true;
+	      continue;
+	    }
+
+	  auto it = _watches.find(ev->wd);
+	  if (it == _watches.end())
+	    continue;
+
+	  if (ev->mask & IN_IGNORED)
+	    {
+	      _watches.erase(it);
+	      continue;
+	    }
+
+	  if (ev->len == 0 || ignored_file_name_p(ev->name, strlen(ev->name)))
+	    continue;
+
+	  std::string path(it->second);
+	  path.push_back('/');
+	  path.append(ev->name);
+
+	  if (ev->mask & IN_ISDIR)
+	    {
+	      if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+		add_watch(path, true);
+	      else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+		remove_watches(path);
+	    }
+	  else if (!(ev->mask & IN_CREATE))
+	    {
+	      // Created files are read once they've been written.
+
+	      _pending.insert(path);
+	    }
+	}
+    }
+
+  return ret;
+}
+
+/* Brings the database up to date with the queued files, appending
+   what changed to CHANGES. Whatever happened to a file since it was
+   queued, it's re-read if it exists, and removed if it doesn't. Files
+   still as this process last wrote them (e.g. renamed into place by
+   database::synchronize()) are skipped, their storages are current. */
+
+void
+database_watcher::apply_changes(std::vector<change> &changes)
+{
+  if (_overflowed)
+    {
+      _overflowed = false;
+      _pending.clear();
+
+      // Directories may have been created or deleted by the lost
+      // events, so the watches are rebuilt too.
+
+      for (const auto &it : _watches)
+	inotify_rm_watch(_fd, it.first);
+      _watches.clear();
+
+      add_watch(_dir, false);
+
+      _db.reload(_dir.c_str());
+
+      changes.push_back(change{change_type::reloaded, database::item()});
+      return;
+    }
+
+  // Finds the items read from the queued files in one pass.
+
+  std::unordered_map<std::string, ssize_t> rows;
+
+  for (const auto &path : _pending)
+    rows[path] = -1;
+
+  for (size_t i = 0; i < _db.items().size(); i++)
+    {
+      auto it = rows.find(_db.items()[i].storage()->path());
+      if (it != rows.end())
+	it->second = i;
+    }
+
+  database::batch batch(_db);
+  std::unordered_map<std::string, bool> added;
+  std::vector<size_t> removed;
+
+  for (const auto &path : _pending)
+    {
+      ssize_t idx = rows[path];
+
+      struct stat st;
+      bool exists = stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+
+      if (idx >= 0 && exists && file_identity(st)
+	  == _db.items()[idx].storage()->written_file())
+	continue;
+
+      bool readable = exists && batch.add_activity(path.c_str());
+
+      if (idx >= 0)
+	{
+	  if (!readable)
+	    changes.push_back(change{change_type::removed, _db.items()[idx]});
+
+	  removed.push_back(idx);
+	}
+
+      if (readable)
+	added[path] = idx >= 0;
+    }
+
+  _pending.clear();
+
+  std::sort(removed.begin(), removed.end());
+  _db.remove_items(removed);
+
+  // Other files' items are replaced by those with the same date.
+
+  std::vector<database::item> replaced;
+  batch.commit(&replaced);
+
+  for (const auto &it : replaced)
+    changes.push_back(change{change_type::removed, it});
+
+  if (added.size() == 0)
+    return;
+
+  // May have been replaced by a later file with the same date.
+
+  for (const auto &it : _db.items())
+    {
+      auto a = added.find(it.storage()->path());
+      if (a != added.end())
+	{
+	  changes.push_back(change{a->second ? change_type::modified
+				   : change_type::added, it});
+	}
+    }
+}
+
+bool
+database_watcher::process_events(int timeout)
+{
+  if (_fd < 0)
+    return false;
+
+  struct pollfd pfd = {_fd, POLLIN, 0};
+
+  if (poll(&pfd, 1, timeout) <= 0 || !read_events())
+    return false;
+
+  for (int i = 0; i < MAX_COALESCE_ROUNDS; i++)
+    {
+      if (poll(&pfd, 1, COALESCE_MS) <= 0 || !read_events())
+	break;
+    }
+
+  std::vector<change> changes;
+  apply_changes(changes);
+
+  if (changes.size() == 0)
+    return false;
+
+  // Observers may remove themselves.
+
+  std::vector<observer *> observers(_observers);
+
+  for (observer *obs : observers)
+    obs->database_changed(*this, changes);
+
+  return true;
+}
+
+} // namespace act
+
+#endif /* __linux__ */
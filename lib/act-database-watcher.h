@@ -0,0 +1,132 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2026 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+
+#ifndef ACT_DATABASE_WATCHER_H
+#define ACT_DATABASE_WATCHER_H
+
+#if defined(__linux__) && __linux__
+
+#include "act-database.h"
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace act {
+
+/* Keeps a database up to date with the files under its activity
+   directory using inotify, instead of reloading everything. Files
+   that are created, written, renamed or deleted are re-read (or
+   removed) once events stop arriving for a short while, then the
+   observers are told which items changed. Nothing happens outside
+   process_events(), so the database is only modified on the thread
+   calling it. */
+
+class database_watcher : public uncopyable
+{
+public:
+  enum class change_type
+    {
+      added,
+      modified,
+      removed,
+      reloaded,			// events were lost, database reloaded
+    };
+
+  struct change
+    {
+      change_type type;
+      database::item item;	// for removed, the item as it was
+    };
+
+  class observer
+    {
+    public:
+      virtual ~observer() {}
+
+      virtual void database_changed(database_watcher &watcher,
+	const std::vector<change> &changes) = 0;
+    };
+
+  // Watches DIR and its subdirectories. DB should have been loaded
+  // from DIR, so that item paths start with it.
+
+  database_watcher(database &db, const char *dir);
+  ~database_watcher();
+
+  // False if inotify couldn't be initialized.
+
+  bool valid() const;
+
+  // Readable when there are events to process, e.g. for poll().
+
+  int fd() const;
+
+  void add_observer(observer *obs);
+  void remove_observer(observer *obs);
+
+  // Waits up to TIMEOUT milliseconds (forever if negative) for the
+  // first event, applies it and any that follow within the
+  // coalescing window, then notifies the observers. Returns true if
+  // the database changed.
+
+  bool process_events(int timeout);
+
+private:
+  database &_db;
+  std::string _dir;
+  int _fd;
+
+  std::unordered_map<int, std::string> _watches;
+  std::vector<observer *> _observers;
+
+  std::set<std::string> _pending;
+  bool _overflowed;
+
+  void add_watch(const std::string &dir, bool scan);
+  void remove_watches(const std::string &dir);
+  bool read_events();
+  void apply_changes(std::vector<change> &changes);
+};
+
+// implementation details
+
+inline bool
+database_watcher::valid() const
+{
+  return _fd >= 0;
+}
+
+inline int
+database_watcher::fd() const
+{
+  return _fd;
+}
+
+} // namespace act
+
+#endif /* __linux__ */
+#endif /* ACT_DATABASE_WATCHER_H */
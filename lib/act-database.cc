@@ -25,167 +25,1754 @@
 #include "act-database.h"
 
 #include "act-config.h"
+#include "act-database-cache.h"
 #include "act-format.h"
+#include "act-gps-summary-cache.h"
 #include "act-util.h"
 
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <new>
 #include <set>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xlocale.h>
 
 #define COMPLETION_DAYS 100
 
-namespace act {
+// Items per unit of work when evaluating queries on multiple threads.
+// A multiple of 64 so no two threads write the same word of a field
+// column's validity bitmap.
+
+#define QUERY_CHUNK_SIZE 256
+
+// Bytes per chunk of reloaded activities, see storage_arena.
+
+#define ARENA_CHUNK_SIZE 65536
+
+namespace act {
+
+namespace {
+
+inline bool
+item_newer_p(const database::item &a, const database::item &b)
+{
+  return a.date() > b.date();
+}
+
+/* Allocates the storages created by one reload thread, together with
+   their shared_ptr control blocks, from large chunks instead of one
+   at a time. Each chunk counts its live allocations (plus one while
+   it's the arena's current chunk) and is freed in one go when that
+   reaches zero. So clearing the database releases its activities
+   chunk by chunk, and a storage still referenced elsewhere, e.g. one
+   being edited, only keeps its own chunk alive. */
+
+struct alignas(16) arena_chunk
+{
+  std::atomic<size_t> refs;
+  size_t used;
+  size_t size;
+
+  char *data() {return reinterpret_cast<char *>(this + 1);}
+};
+
+class storage_arena : public uncopyable
+{
+  arena_chunk *_chunk;
+
+  // Each allocation is preceded by a pointer to its chunk, padded
+  // to keep the allocation aligned.
+
+  enum {header_size = alignof(arena_chunk)};
+
+  static void release(arena_chunk *chunk);
+
+public:
+  storage_arena() : _chunk(nullptr) {}
+  ~storage_arena();
+
+  void *allocate(size_t size);
+  static void deallocate(void *ptr);
+};
+
+storage_arena::~storage_arena()
+{
+  if (_chunk != nullptr)
+    release(_chunk);
+}
+
+void
+storage_arena::release(arena_chunk *chunk)
+{
+  if (--chunk->refs == 0)
+    free(chunk);
+}
+
+void *
+storage_arena::allocate(size_t size)
+{
+  size_t needed = header_size + ((size + header_size - 1)
+				 & ~(size_t)(header_size - 1));
+
+  if (_chunk == nullptr || _chunk->used + needed > _chunk->size)
+    {
+      size_t chunk_size = std::max((size_t)ARENA_CHUNK_SIZE, needed);
+
+      void *mem = malloc(sizeof(arena_chunk) + chunk_size);
+      if (mem == nullptr)
+	throw std::bad_alloc();
+
+      arena_chunk *chunk = new (mem) arena_chunk;
+      chunk->refs = 1;
+      chunk->used = 0;
+      chunk->size = chunk_size;
+
+      if (_chunk != nullptr)
+	release(_chunk);
+      _chunk = chunk;
+    }
+
+  char *ptr = _chunk->data() + _chunk->used;
+  _chunk->used += needed;
+  _chunk->refs++;
+
+  *reinterpret_cast<arena_chunk **>(ptr) = _chunk;
+  return ptr + header_size;
+}
+
+void
+storage_arena::deallocate(void *ptr)
+{
+  char *header = static_cast<char *>(ptr) - header_size;
+  release(*reinterpret_cast<arena_chunk **>(header));
+}
+
+template<typename T>
+struct arena_allocator
+{
+  typedef T value_type;
+
+  storage_arena *arena;
+
+  explicit arena_allocator(storage_arena *a) : arena(a) {}
+
+  template<typename U>
+  arena_allocator(const arena_allocator<U> &rhs) : arena(rhs.arena) {}
+
+  T *allocate(size_t n)
+    {
+      return static_cast<T *>(arena->allocate(n * sizeof(T)));
+    }
+
+  void deallocate(T *ptr, size_t)
+    {
+      storage_arena::deallocate(ptr);
+    }
+
+  template<typename U>
+  bool operator==(const arena_allocator<U> &rhs) const
+    {
+      return arena == rhs.arena;
+    }
+
+  template<typename U>
+  bool operator!=(const arena_allocator<U> &rhs) const
+    {
+      return arena != rhs.arena;
+    }
+};
+
+activity_storage_ref
+make_storage(storage_arena *arena)
+{
+  if (arena != nullptr)
+    {
+      return std::allocate_shared<activity_storage>
+	(arena_allocator<activity_storage>(arena));
+    }
+  else
+    return std::make_shared<activity_storage>();
+}
+
+} // anonymous namespace
+
+database::database()
+: _defer_bodies(false),
+  _dirty_set(std::make_shared<activity_dirty_set>()),
+  _items_serial(0)
+{
+}
+
+database::database(const database &rhs)
+: _items(rhs._items),
+  _defer_bodies(rhs._defer_bodies),
+  _dirty_set(rhs._dirty_set),
+  _items_serial(0)
+{
+}
+
+database::~database()
+{
+  for (live_query *lq : _live_queries)
+    lq->_db = nullptr;
+}
+
+void
+database::clear()
+{
+  _items.clear();
+  _items_serial++;
+  _dirty_set = std::make_shared<activity_dirty_set>();
+  _dirty_set->set_journaling(_live_queries.size() != 0);
+  _column_rows.clear();
+  _columns.clear();
+  _keyword_index.clear();
+  _trigram_index.clear();
+}
+
+void
+database::reload()
+{
+  reload(shared_config().activity_dir());
+}
+
+struct database::reload_state
+{
+  database_cache *cache;
+  std::vector<item> items;
+
+  // If true, body trigrams are read from the cache, or computed and
+  // written to it. Trigrams aren't computed for deferred bodies.
+
+  bool index_bodies;
+  bool defer_bodies;
+  storage_trigrams trigrams;
+
+  std::unique_ptr<storage_arena> arena;
+
+  reload_state(database_cache *c, bool defer)
+  : cache(c),
+    index_bodies(c != nullptr && shared_config().use_grep_index()),
+    defer_bodies(defer)
+    {
+      if (shared_config().use_database_arena())
+	arena.reset(new storage_arena);
+    }
+};
+
+void
+database::reload(const std::vector<date_range> &dates)
+{
+  reload(shared_config().activity_dir(), dates);
+}
+
+void
+database::reload(const char *path)
+{
+  reload(path, std::vector<date_range>());
+}
+
+void
+database::reload(const char *path, const std::vector<date_range> &dates)
+{
+  clear();
+
+  // Item paths are built from the directory name, it's normalized
+  // the same way as database_watcher's so that their paths match.
+
+  std::string dir(path);
+  strip_trailing_slashes(dir);
+  path = dir.c_str();
+
+  std::unique_ptr<database_cache> cache;
+
+  if (shared_config().use_database_cache())
+    {
+      cache.reset(new database_cache(path));
+      cache->load();
+    }
+
+  int thread_count = shared_config().reload_threads();
+  if (thread_count <= 0)
+    thread_count = std::max(1U, std::thread::hardware_concurrency());
+
+  storage_trigrams trigrams;
+
+  if (thread_count == 1 && dates.size() == 0)
+    {
+      reload_state state(cache.get(), _defer_bodies);
+
+      map_directory_files(path, reload_callback, &state);
+
+      using std::swap;
+      swap(_items, state.items);
+      swap(trigrams, state.trigrams);
+
+      std::sort(_items.begin(), _items.end(), item_newer_p);
+    }
+  else
+    {
+      std::vector<std::string> dirs, files;
+      list_reload_units(path, dates, dirs, files);
+      reload_units(dirs, files, cache.get(), thread_count, trigrams);
+    }
+
+  set_body_trigrams(trigrams);
+
+  _items_serial++;
+
+  for (auto &it : _items)
+    it._storage->set_dirty_set(_dirty_set);
+
+  if (cache)
+    cache->save(dates.size() == 0);
+
+  // Records added while the previous items were in use.
+
+  gps_summary_cache::shared_cache().save();
+}
+
+namespace {
+
+// true if [start, end) intersects any of 'dates'.
+
+bool
+date_ranges_overlap(const std::vector<date_range> &dates,
+		    time_t start, time_t end)
+{
+  for (const auto &it : dates)
+    {
+      if (it.start < end
+	  && (start <= it.start || start - it.start < it.length))
+	return true;
+    }
+
+  return false;
+}
+
+// Returns the numeric value of the last component of 'path' if it
+// has exactly 'digits' digits, else -1.
+
+int
+numeric_path_component(const std::string &path, size_t digits)
+{
+  size_t idx = path.rfind('/');
+  idx = idx != std::string::npos ? idx + 1 : 0;
+
+  if (path.size() - idx != digits)
+    return -1;
+
+  int value = 0;
+  for (size_t i = idx; i < path.size(); i++)
+    {
+      if (!isdigit_l(path[i], nullptr))
+	return -1;
+      value = value * 10 + (path[i] - '0');
+    }
+
+  return value;
+}
+
+} // anonymous namespace
+
+/* Splits the directory into work units, normally the YYYY/MM
+   directories created by activity::make_filename(). If 'dates' is
+   non-empty, directories following that layout are skipped unless
+   their month could contain one of the dates (allowing a day either
+   side for timezone changes). Anything else is always loaded. */
+
+void
+database::list_reload_units(const char *path,
+			    const std::vector<date_range> &dates,
+			    std::vector<std::string> &dirs,
+			    std::vector<std::string> &files)
+{
+  const time_t margin = 24*60*60;
+
+  std::vector<std::string> year_dirs;
+
+  list_directory(path, year_dirs, files);
+
+  for (const auto &year_dir : year_dirs)
+    {
+      int year = numeric_path_component(year_dir, 4);
+
+      if (year < 0)
+	{
+	  dirs.push_back(year_dir);
+	  continue;
+	}
+
+      if (dates.size() != 0
+	  && !date_ranges_overlap(dates, year_time(year) - margin,
+				  year_time(year + 1) + margin))
+	continue;
+
+      std::vector<std::string> month_dirs;
+
+      list_directory(year_dir.c_str(), month_dirs, files);
+
+      for (const auto &month_dir : month_dirs)
+	{
+	  int month = numeric_path_component(month_dir, 2);
+
+	  if (dates.size() != 0 && month >= 1 && month <= 12
+	      && !date_ranges_overlap(dates,
+				      month_time(year, month - 1) - margin,
+				      month_time(year, month) + margin))
+	    continue;
+
+	  dirs.push_back(month_dir);
+	}
+    }
+}
+
+/* Parses the work units on 'thread_count' threads. Each thread
+   collects and sorts its own items, which are then merged into
+   _items. */
+
+void
+database::reload_units(const std::vector<std::string> &dirs,
+		       const std::vector<std::string> &files,
+		       database_cache *cache, int thread_count,
+		       storage_trigrams &trigrams)
+{
+  size_t unit_count = dirs.size() + files.size();
+
+  if ((size_t)thread_count > unit_count)
+    thread_count = std::max((int)unit_count, 1);
+
+  std::vector<reload_state> states;
+  states.reserve(thread_count);
+  for (int i = 0; i < thread_count; i++)
+    states.emplace_back(cache, _defer_bodies);
+  std::atomic<size_t> next_unit(0);
+
+  auto worker = [&] (reload_state *state) {
+    while (1)
+      {
+	size_t i = next_unit++;
+	if (i >= unit_count)
+	  break;
+	if (i < dirs.size())
+	  map_directory_files(dirs[i].c_str(), reload_callback, state);
+	else
+	  reload_callback(files[i - dirs.size()].c_str(), state);
+      }
+
+    std::sort(state->items.begin(), state->items.end(), item_newer_p);
+  };
+
+  std::vector<std::thread> threads;
+
+  for (int i = 1; i < thread_count; i++)
+    threads.emplace_back(worker, &states[i]);
+
+  worker(&states[0]);
+
+  for (auto &it : threads)
+    it.join();
+
+  size_t total = 0;
+  for (const auto &it : states)
+    total += it.items.size();
+
+  _items.reserve(total);
+
+  for (auto &it : states)
+    {
+      size_t middle = _items.size();
+
+      std::move(it.items.begin(), it.items.end(),
+		std::back_inserter(_items));
+
+      std::inplace_merge(_items.begin(), _items.begin() + middle,
+			 _items.end(), item_newer_p);
+
+      std::move(it.trigrams.begin(), it.trigrams.end(),
+		std::back_inserter(trigrams));
+    }
+}
+
+/* Seeds the trigram index with trigrams found in (or added to) the
+   cache while reloading, so they're not recomputed on first use. */
+
+void
+database::set_body_trigrams(storage_trigrams &trigrams)
+{
+  if (trigrams.size() == 0)
+    return;
+
+  std::unordered_map<const activity_storage *,
+    trigram_index::trigram_set *> map;
+
+  for (auto &it : trigrams)
+    map[it.first] = &it.second;
+
+  _trigram_index.set_row_count(_items.size());
+
+  for (size_t i = 0; i < _items.size(); i++)
+    {
+      auto it = map.find(_items[i]._storage.get());
+      if (it != map.end())
+	_trigram_index.set_row(i, _items[i]._storage, *it->second);
+    }
+}
+
+void
+database::reload_callback(const char *path, void *ctx)
+{
+  reload_state *state = static_cast<reload_state *>(ctx);
+
+  activity_storage_ref storage = make_storage(state->arena.get());
+  time_t date = 0;
+
+  struct stat st;
+  bool have_stat = state->cache != nullptr && stat(path, &st) == 0;
+
+  bool hit = have_stat && state->cache->lookup(path, st, date, *storage,
+					       !state->defer_bodies);
+
+  if (!hit)
+    {
+      if (!storage->read_file(path, !state->defer_bodies))
+	return;
+
+      if (const std::string *str = storage->field_ptr("Date"))
+	parse_date_time(*str, &date, nullptr);
+    }
+
+  storage->set_path(path);
+
+  trigram_index::trigram_set trigrams;
+  bool has_trigrams = false;
+
+  if (have_stat && state->index_bodies)
+    {
+      if (hit && state->cache->lookup_trigrams(path, trigrams))
+	has_trigrams = true;
+      else if (storage->body_loaded())
+	{
+	  trigram_index::string_trigrams(storage->body(), trigrams);
+	  has_trigrams = true;
+	  hit = false;
+	}
+    }
+
+  if (have_stat)
+    {
+      state->cache->update(path, st, date, storage, hit,
+			   has_trigrams ? &trigrams : nullptr);
+    }
+
+  if (storage->field_ptr("Date") == nullptr)
+    return;
+
+  if (has_trigrams)
+    {
+      state->trigrams.resize(state->trigrams.size() + 1);
+      state->trigrams.back().first = storage.get();
+      using std::swap;
+      swap(state->trigrams.back().second, trigrams);
+    }
+
+  state->items.resize(state->items.size() + 1);
+  item &it = state->items.back();
+
+  it._date = date;
+
+  using std::swap;
+  swap(it._storage, storage);
+}
+
+bool
+database::add_activity(const char *path)
+{
+  item new_item;
+
+  new_item._storage = std::make_shared<activity_storage> ();
+
+  if (!new_item._storage->read_file(path))
+    return false;
+
+  new_item._storage->set_path(path);
+
+  const std::string *date = new_item._storage->field_ptr("Date");
+  if (date == nullptr)
+    return false;
+
+  new_item._storage->set_dirty_set(_dirty_set);
+
+  parse_date_time(*date, &new_item._date, nullptr);
+
+  auto it = std::lower_bound(_items.begin(), _items.end(), new_item._date,
+			     [] (const item &a, time_t d) {
+			       return d < a._date;
+			     });
+
+  bool keywords_indexed = _keyword_index.row_count() == _items.size();
+  bool bodies_indexed = _trigram_index.row_count() == _items.size();
+
+  _items_serial++;
+
+  if (it == _items.end() || it->_date != new_item._date)
+    {
+      size_t idx = it - _items.begin();
+      _items.insert(it, new_item);
+      if (keywords_indexed)
+	_keyword_index.insert_row(idx);
+      if (bodies_indexed)
+	_trigram_index.insert_row(idx);
+    }
+  else
+    {
+      using std::swap;
+      swap(*it, new_item);
+    }
+
+  return true;
+}
+
+ssize_t
+database::find_activity(const char *path) const
+{
+  for (size_t i = 0; i < _items.size(); i++)
+    {
+      if (strcmp(_items[i]._storage->path(), path) == 0)
+	return i;
+    }
+
+  return -1;
+}
+
+void
+database::remove_item(size_t idx)
+{
+  if (_keyword_index.row_count() == _items.size())
+    _keyword_index.remove_row(idx);
+  if (_trigram_index.row_count() == _items.size())
+    _trigram_index.remove_row(idx);
+
+  _items.erase(_items.begin() + idx);
+  _items_serial++;
+
+  _column_rows.clear();
+  _columns.clear();
+}
+
+void
+database::remove_items(const std::vector<size_t> &rows)
+{
+  if (rows.size() == 0)
+    return;
+
+  if (_keyword_index.row_count() == _items.size())
+    _keyword_index.remove_rows(rows);
+  if (_trigram_index.row_count() == _items.size())
+    _trigram_index.remove_rows(rows);
+
+  auto it = rows.begin();
+  size_t count = 0;
+
+  for (size_t i = 0; i < _items.size(); i++)
+    {
+      if (it != rows.end() && *it == i)
+	{
+	  ++it;
+	  continue;
+	}
+
+      if (count != i)
+	_items[count] = std::move(_items[i]);
+      count++;
+    }
+
+  _items.erase(_items.begin() + count, _items.end());
+  _items_serial++;
+
+  _column_rows.clear();
+  _columns.clear();
+}
+
+/* Merges ITEMS (sorted newest first, no two with the same date) into
+   the database in one pass, replacing existing items with equal dates
+   as add_activity() does (they're moved to REPLACED, if non-null).
+   The indices are renumbered rather than rebuilt. */
+
+void
+database::merge_items(std::vector<item> &items, std::vector<item> *replaced)
+{
+  if (items.size() == 0)
+    return;
+
+  size_t old_count = _items.size();
+
+  std::vector<item> merged;
+  merged.reserve(old_count + items.size());
+
+  std::vector<size_t> old_rows(old_count);
+
+  size_t i = 0, j = 0;
+  while (i < old_count || j < items.size())
+    {
+      if (j == items.size()
+	  || (i < old_count && _items[i]._date > items[j]._date))
+	{
+	  old_rows[i] = merged.size();
+	  merged.push_back(std::move(_items[i++]));
+	}
+      else if (i == old_count || items[j]._date > _items[i]._date)
+	merged.push_back(std::move(items[j++]));
+      else
+	{
+	  /* Same date: the new storage replaces the old in place, its
+	     index rows are revalidated by storage identity. */
+
+	  if (replaced != nullptr)
+	    replaced->push_back(std::move(_items[i]));
+
+	  old_rows[i++] = merged.size();
+	  merged.push_back(std::move(items[j++]));
+	}
+    }
+
+  if (_keyword_index.row_count() == old_count)
+    _keyword_index.remap_rows(old_rows, merged.size());
+  if (_trigram_index.row_count() == old_count)
+    _trigram_index.remap_rows(old_rows, merged.size());
+
+  _column_rows.clear();
+  _columns.clear();
+
+  _items.swap(merged);
+  _items_serial++;
+  items.clear();
+}
+
+database::batch::batch(database &db)
+: _db(db)
+{
+}
+
+bool
+database::batch::add_activity(const char *path)
+{
+  item new_item;
+
+  new_item._storage = std::make_shared<activity_storage> ();
+
+  if (!new_item._storage->read_file(path))
+    return false;
+
+  new_item._storage->set_path(path);
+
+  const std::string *date = new_item._storage->field_ptr("Date");
+  if (date == nullptr)
+    return false;
+
+  parse_date_time(*date, &new_item._date, nullptr);
+
+  _items.push_back(std::move(new_item));
+  return true;
+}
+
+void
+database::batch::set_field(const activity_storage_ref &storage,
+			   const std::string &name, const std::string &value)
+{
+  _edits.push_back(edit{storage, name, value, false});
+}
+
+void
+database::batch::delete_field(const activity_storage_ref &storage,
+			      const std::string &name)
+{
+  _edits.push_back(edit{storage, name, std::string(), true});
+}
+
+size_t
+database::batch::size() const
+{
+  return _items.size() + _edits.size();
+}
+
+void
+database::batch::commit(std::vector<item> *replaced)
+{
+  std::vector<activity_storage_ref> modified;
+  std::unordered_set<activity_storage *> seen;
+
+  for (auto &e : _edits)
+    {
+      if (e.remove)
+	e.storage->delete_field(e.name);
+      else
+	(*e.storage)[e.name] = e.value;
+
+      if (seen.insert(e.storage.get()).second)
+	modified.push_back(e.storage);
+    }
+
+  for (auto &storage : modified)
+    storage->increment_seed();
+
+  _edits.clear();
+
+  /* Newest first; of several items with the same date the one added
+     last wins, as if each had been passed to add_activity(). */
+
+  std::stable_sort(_items.begin(), _items.end(),
+		   [] (const item &a, const item &b) {
+		     return a._date > b._date;
+		   });
+
+  auto last = _items.begin();
+  for (auto it = _items.begin(); it != _items.end(); ++it)
+    {
+      if (it != last && it->_date == last->_date)
+	*last = std::move(*it);
+      else if (it != last)
+	*++last = std::move(*it);
+    }
+  if (last != _items.end())
+    _items.erase(last + 1, _items.end());
+
+  for (auto &it : _items)
+    it._storage->set_dirty_set(_db._dirty_set);
+
+  _db.merge_items(_items, replaced);
+
+  synchronize_storages(modified);
+}
+
+namespace {
+
+inline time_t
+date_range_end(const date_range &r)
+{
+  if (r.start > 0 && r.length > LONG_MAX - r.start)
+    return LONG_MAX;
+  else
+    return r.start + r.length;
+}
+
+} // anonymous namespace
+
+/* Converts 'dates' into a list of [begin, end) index ranges of
+   _items, in the same (newest first) order as _items. Overlapping or
+   adjacent date ranges are merged first so no item appears twice. */
+
+void
+database::date_range_slices(const std::vector<date_range> &dates,
+			    std::vector<std::pair<size_t, size_t>> &slices) const
+{
+  slices.clear();
+
+  // If no date ranges everything matches.
+
+  if (dates.size() == 0)
+    {
+      slices.push_back(std::make_pair(0, _items.size()));
+      return;
+    }
+
+  std::vector<std::pair<time_t, time_t>> merged;
+
+  for (const auto &it : dates)
+    {
+      if (!it.is_empty())
+	merged.push_back(std::make_pair(it.start, date_range_end(it)));
+    }
+
+  std::sort(merged.begin(), merged.end(),
+	    [] (const std::pair<time_t, time_t> &a,
+		const std::pair<time_t, time_t> &b) {
+	      return a.first > b.first;
+	    });
+
+  size_t count = 0;
+  for (const auto &it : merged)
+    {
+      if (count != 0 && it.second >= merged[count-1].first)
+	{
+	  std::pair<time_t, time_t> &last = merged[count-1];
+	  last.first = it.first;
+	  last.second = std::max(last.second, it.second);
+	}
+      else
+	merged[count++] = it;
+    }
+
+  merged.resize(count);
+
+  auto newer_than = [] (const item &a, time_t d) {return a.date() >= d;};
+
+  for (const auto &it : merged)
+    {
+      auto first = std::lower_bound(_items.begin(), _items.end(),
+				    it.second, newer_than);
+      auto last = std::lower_bound(first, _items.end(), it.first,
+				   newer_than);
+
+      if (first != last)
+	{
+	  slices.push_back(std::make_pair(first - _items.begin(),
+					  last - _items.begin()));
+	}
+    }
+}
+
+void
+database::execute_query(const query &q, std::vector<item> &result)
+{
+  result.clear();
+
+  query_cursor cursor(*this, q);
+
+  item it;
+  while (cursor.next(it))
+    result.push_back(it);
+}
+
+void
+database::execute_query(const query &q, std::vector<size_t> &result)
+{
+  result.clear();
+
+  query_cursor cursor(*this, q);
+
+  size_t idx;
+  while (cursor.next(idx))
+    result.push_back(idx);
+}
+
+database::query_cursor::query_cursor(const database &db, const query &q)
+: _db(db),
+  _program(q.term()),
+  _has_term(q.term() != nullptr),
+  _use_candidates(false),
+  _slice(0),
+  _row(0),
+  _to_skip(q.skip_count()),
+  _to_add(q.max_count()),
+  _match(0),
+  _last_date(0),
+  _cancel(nullptr),
+  _progress_fn(nullptr),
+  _progress_ctx(nullptr),
+  _visited(0),
+  _total(0)
+{
+  _db.date_range_slices(q.date_ranges(), _slices);
+
+  if (q.resume_date() != 0)
+    {
+      // Items older than the resume date start at index OLDER.
+
+      size_t older = std::lower_bound(_db._items.begin(), _db._items.end(),
+				      q.resume_date(),
+				      [] (const item &a, time_t d) {
+					return a.date() >= d;
+				      }) - _db._items.begin();
+
+      for (auto &it : _slices)
+	it.first = std::min(std::max(it.first, older), it.second);
+    }
+
+  if (_has_term)
+    {
+      _db.validate_keyword_index();
+      _use_candidates = q.term()->candidate_rows(_db, _candidates);
+    }
+
+  for (const auto &it : _slices)
+    {
+      if (_use_candidates)
+	{
+	  _total += (std::lower_bound(_candidates.begin(), _candidates.end(),
+				      it.second)
+		     - std::lower_bound(_candidates.begin(), _candidates.end(),
+					it.first));
+	}
+      else
+	_total += it.second - it.first;
+    }
+
+  _thread_count = shared_config().query_threads();
+  if (_thread_count <= 0)
+    _thread_count = std::max(1U, std::thread::hardware_concurrency());
+}
+
+void
+database::query_cursor::set_cancel_flag(const std::atomic<bool> *flag)
+{
+  _cancel = flag;
+}
+
+void
+database::query_cursor::set_progress_callback(void (*fun) (size_t visited,
+						size_t total, void *ctx),
+					      void *ctx)
+{
+  _progress_fn = fun;
+  _progress_ctx = ctx;
+}
+
+bool
+database::query_cursor::next(size_t &idx)
+{
+  while (_to_add != 0 && !cancelled())
+    {
+      if (_match == _matches.size() && !fill_matches())
+	return false;
+
+      size_t i = _matches[_match++];
+
+      if (_to_skip != 0)
+	{
+	  _to_skip--;
+	  continue;
+	}
+
+      _to_add--;
+      _last_date = _db._items[i].date();
+      idx = i;
+      return true;
+    }
+
+  return false;
+}
+
+bool
+database::query_cursor::next(item &it)
+{
+  size_t idx;
+  if (!next(idx))
+    return false;
+
+  it = _db._items[idx];
+  return true;
+}
+
+bool
+database::query_cursor::next_row(size_t &idx)
+{
+  while (_slice < _slices.size())
+    {
+      const auto &slice = _slices[_slice];
+
+      if (_row < slice.first)
+	_row = slice.first;
+
+      if (_use_candidates)
+	{
+	  auto it = std::lower_bound(_candidates.begin(), _candidates.end(),
+				     _row);
+	  if (it != _candidates.end() && *it < slice.second)
+	    {
+	      idx = *it;
+	      _row = idx + 1;
+	      return true;
+	    }
+	}
+      else if (_row < slice.second)
+	{
+	  idx = _row++;
+	  return true;
+	}
+
+      _slice++;
+    }
+
+  return false;
+}
+
+/* Refills _matches with the next matching rows. On a single thread
+   rows are evaluated until one matches. Otherwise a batch of chunks
+   is evaluated in parallel, as many as could still contribute to the
+   result. */
+
+bool
+database::query_cursor::fill_matches()
+{
+  _matches.clear();
+  _match = 0;
+
+  size_t idx;
+
+  if (!_has_term || _thread_count <= 1)
+    {
+      while (!cancelled() && next_row(idx))
+	{
+	  if (++_visited % QUERY_CHUNK_SIZE == 0 && _progress_fn != nullptr)
+	    _progress_fn(_visited, _total, _progress_ctx);
+
+	  if (_has_term)
+	    {
+	      activity a (_db._items[idx].storage());
+	      if (!_program(_db, idx, a))
+		continue;
+	    }
+
+	  _matches.push_back(idx);
+	  return true;
+	}
+
+      return false;
+    }
+
+  std::vector<size_t> rows;
+
+  // Keep going until a batch has at least one match.
+
+  while (_matches.size() == 0)
+    {
+      size_t end_chunk = 0;
+      rows.clear();
+
+      while (1)
+	{
+	  size_t slice = _slice, row = _row;
+
+	  if (!next_row(idx))
+	    break;
+
+	  if (rows.size() == 0)
+	    end_chunk = idx / QUERY_CHUNK_SIZE + _thread_count * 4;
+	  else if (idx / QUERY_CHUNK_SIZE >= end_chunk)
+	    {
+	      _slice = slice, _row = row;
+	      break;
+	    }
+
+	  rows.push_back(idx);
+	}
+
+      if (rows.size() == 0)
+	return false;
+
+      size_t needed = _to_skip + _to_add;
+      if (needed < _to_skip)
+	needed = SIZE_T_MAX;
+
+      _db.evaluate_rows(_program, rows, _thread_count, needed, _cancel,
+			_matches);
+
+      if (cancelled())
+	return false;
+
+      _visited += rows.size();
+      if (_progress_fn != nullptr)
+	_progress_fn(_visited, _total, _progress_ctx);
+    }
+
+  return true;
+}
+
+time_t
+database::query_cursor::last_date() const
+{
+  return _last_date;
+}
+
+database::live_query::live_query(database &db, const query &q)
+: _db(&db),
+  _program(q.term()),
+  _has_term(q.term() != nullptr),
+  _dates(q.date_ranges()),
+  _valid(false),
+  _items_serial(0),
+  _journal_serial(0)
+{
+  _db->_live_queries.push_back(this);
+  _db->_dirty_set->set_journaling(true);
+
+  update();
+}
+
+database::live_query::~live_query()
+{
+  if (_db == nullptr)
+    return;
+
+  auto &vec = _db->_live_queries;
+  vec.erase(std::remove(vec.begin(), vec.end(), this), vec.end());
 
-database::database()
-{
+  if (vec.size() == 0)
+    _db->_dirty_set->set_journaling(false);
+  else
+    _db->trim_journal();
 }
 
-database::database(const database &rhs)
-: _items(rhs._items)
+bool
+database::live_query::matches(const item &it) const
 {
+  if (_dates.size() != 0)
+    {
+      bool in_range = false;
+
+      for (const auto &range : _dates)
+	{
+	  if (range.contains(it.date()))
+	    {
+	      in_range = true;
+	      break;
+	    }
+	}
+
+      if (!in_range)
+	return false;
+    }
+
+  if (!_has_term)
+    return true;
+
+  activity a(it.storage());
+  return _program(a);
 }
 
 void
-database::clear()
+database::live_query::insert_item(const item &it)
 {
-  _items.clear();
+  auto pos = std::upper_bound(_items.begin(), _items.end(), it.date(),
+			      [] (time_t d, const item &a) {
+				return d > a.date();
+			      });
+
+  _items.insert(pos, it);
 }
 
 void
-database::reload()
+database::live_query::erase_item(const item &it)
 {
-  reload(shared_config().activity_dir());
+  auto pos = std::lower_bound(_items.begin(), _items.end(), it.date(),
+			      [] (const item &a, time_t d) {
+				return a.date() > d;
+			      });
+
+  for (; pos != _items.end() && pos->date() == it.date(); ++pos)
+    {
+      if (pos->storage() == it.storage())
+	{
+	  _items.erase(pos);
+	  break;
+	}
+    }
 }
 
-void
-database::reload(const char *path)
+/* Visits every item of the database, evaluating those that weren't
+   seen before or whose storage seed changed. */
+
+bool
+database::live_query::rebuild(std::vector<item> *added,
+			      std::vector<item> *removed)
 {
-  _items.clear();
+  std::unordered_map<const activity_storage *, row> rows;
+  rows.reserve(_db->_items.size());
 
-  map_directory_files(path, reload_callback, this);
+  std::vector<item> items;
+  bool changed = false;
 
-  std::sort(_items.begin(), _items.end(),
-	    [] (const item &a, const item &b) {
-	      return a.date() > b.date();
-	    });
+  for (const auto &it : _db->_items)
+    {
+      const activity_storage *storage = it._storage.get();
+
+      auto old = _rows.find(storage);
+      bool was_matched = false;
+
+      row r;
+
+      if (old != _rows.end())
+	{
+	  was_matched = old->second.matched;
+
+	  if (old->second.seed == storage->seed()
+	      && old->second.it.date() == it.date())
+	    r = old->second;
+
+	  _rows.erase(old);
+	}
+
+      if (r.it.storage() == nullptr)
+	r = row{it, storage->seed(), matches(it)};
+
+      if (r.matched)
+	items.push_back(it);
+
+      if (r.matched != was_matched)
+	{
+	  changed = true;
+	  if (r.matched && added != nullptr)
+	    added->push_back(it);
+	  else if (!r.matched && removed != nullptr)
+	    removed->push_back(it);
+	}
+
+      rows[storage] = std::move(r);
+    }
+
+  // Whatever is left was removed from the database.
+
+  for (const auto &it : _rows)
+    {
+      if (it.second.matched)
+	{
+	  changed = true;
+	  if (removed != nullptr)
+	    removed->push_back(it.second.it);
+	}
+    }
+
+  using std::swap;
+  swap(_rows, rows);
+  swap(_items, items);
+
+  return changed;
+}
+
+bool
+database::live_query::update(std::vector<item> *added,
+			     std::vector<item> *removed)
+{
+  if (_db == nullptr)
+    return false;
+
+  std::vector<const activity_storage *> storages;
+  _journal_serial = _db->_dirty_set->journal_since(_journal_serial, storages);
+
+  bool changed = false;
+
+  if (!_valid || _items_serial != _db->_items_serial)
+    {
+      changed = rebuild(added, removed);
+      _valid = true;
+      _items_serial = _db->_items_serial;
+    }
+  else
+    {
+      for (const activity_storage *storage : storages)
+	{
+	  // Rows keep their storage alive, so this can't be a stale
+	  // pointer to a different storage.
+
+	  auto it = _rows.find(storage);
+	  if (it == _rows.end())
+	    continue;
+
+	  row &r = it->second;
+	  if (r.seed == storage->seed())
+	    continue;
+
+	  r.seed = storage->seed();
+
+	  bool matched = matches(r.it);
+	  if (matched == r.matched)
+	    continue;
+
+	  r.matched = matched;
+	  changed = true;
+
+	  if (matched)
+	    {
+	      insert_item(r.it);
+	      if (added != nullptr)
+		added->push_back(r.it);
+	    }
+	  else
+	    {
+	      erase_item(r.it);
+	      if (removed != nullptr)
+		removed->push_back(r.it);
+	    }
+	}
+    }
+
+  _db->trim_journal();
+
+  return changed;
+}
+
+database::query_task::query_task(const database &db, const query &q,
+				 delegate *d)
+: _cursor(db, q),
+  _delegate(d),
+  _cancelled(false),
+  _finished(false)
+{
+  _cursor.set_cancel_flag(&_cancelled);
+
+  if (_delegate != nullptr)
+    _cursor.set_progress_callback(progress_callback, this);
+
+  _thread = std::thread(&query_task::run, this);
+}
+
+database::query_task::~query_task()
+{
+  cancel();
+  wait();
 }
 
 void
-database::reload_callback(const char *path, void *ctx)
+database::query_task::cancel()
 {
-  database *db = static_cast<database *>(ctx);
+  _cancelled = true;
+}
 
-  activity_storage_ref storage = std::make_shared<activity_storage> ();
+void
+database::query_task::wait()
+{
+  if (_thread.joinable())
+    _thread.join();
+}
 
-  if (!storage->read_file(path))
-    return;
+void
+database::query_task::progress_callback(size_t visited, size_t total,
+					void *ctx)
+{
+  query_task *task = static_cast<query_task *>(ctx);
+  task->_delegate->query_progress(*task, visited, total);
+}
 
-  storage->set_path(path);
+void
+database::query_task::run()
+{
+  item it;
+  while (_cursor.next(it))
+    _results.push_back(it);
 
-  const std::string *date = storage->field_ptr("Date");
-  if (date == nullptr)
+  if (_cancelled)
     return;
 
-  db->_items.resize(db->_items.size() + 1);
-  item &it = db->_items.back();
+  _finished = true;
 
-  parse_date_time(*date, &it._date, nullptr);
-
-  using std::swap;
-  swap(it._storage, storage);
+  if (_delegate != nullptr)
+    {
+      _delegate->query_progress(*this, _cursor.total_count(),
+				_cursor.total_count());
+      _delegate->query_finished(*this);
+    }
 }
 
-bool
-database::add_activity(const char *path)
+void
+database::trim_journal()
 {
-  item new_item;
+  uint64_t serial = UINT64_MAX;
 
-  new_item._storage = std::make_shared<activity_storage> ();
+  for (const live_query *lq : _live_queries)
+    serial = std::min(serial, lq->_journal_serial);
 
-  if (!new_item._storage->read_file(path))
+  _dirty_set->trim_journal(serial);
+}
+
+bool
+database::find_body_trigrams(const trigram_index::trigram_set &set,
+			     std::vector<size_t> &rows) const
+{
+  if (!shared_config().use_grep_index())
     return false;
 
-  new_item._storage->set_path(path);
+  _trigram_index.set_row_count(_items.size());
 
-  const std::string *date = new_item._storage->field_ptr("Date");
-  if (date == nullptr)
-    return false;
+  // Rows whose bodies haven't been read (and had no cached trigrams)
+  // are candidates, they're indexed once the grep has read them.
 
-  parse_date_time(*date, &new_item._date, nullptr);
+  std::vector<size_t> unindexed;
 
-  auto it = std::lower_bound(_items.begin(), _items.end(), new_item._date,
-			     [] (const item &a, time_t d) {
-			       return d < a._date;
-			     });
+  for (size_t i = 0; i < _items.size(); i++)
+    {
+      if (!_trigram_index.update_row(i, _items[i]._storage))
+	unindexed.push_back(i);
+    }
 
-  if (it == _items.end())
-    _items.push_back(new_item);
-  else if (it->_date != new_item._date)
-    _items.insert(it, new_item);
-  else
+  _trigram_index.find(set, rows);
+
+  if (unindexed.size() != 0)
     {
-      using std::swap;
-      swap(*it, new_item);
+      std::vector<size_t> indexed;
+      indexed.swap(rows);
+      std::merge(indexed.begin(), indexed.end(), unindexed.begin(),
+		 unindexed.end(), std::back_inserter(rows));
     }
 
   return true;
 }
 
 void
-database::execute_query(const query &q, std::vector<item> &result)
+database::validate_keyword_index() const
 {
-  result.clear();
+  _keyword_index.set_row_count(_items.size());
 
-  /* FIXME: this blows. */
+  for (size_t i = 0; i < _items.size(); i++)
+    _keyword_index.update_row(i, _items[i]._storage);
+}
 
-  size_t to_skip = q.skip_count();
-  size_t to_add = q.max_count();
+void
+database::validate_column_row(size_t idx) const
+{
+  if (_column_rows.size() != _items.size())
+    _column_rows.resize(_items.size(), column_row{nullptr, 0});
 
-  for (auto &it : _items)
-    {
-      // If no date ranges everything matches.
+  const activity_storage_ref &storage = _items[idx]._storage;
+  column_row &row = _column_rows[idx];
 
-      if (q.date_ranges().size() != 0)
+  if (row.storage != storage || row.seed != storage->seed())
+    {
+      for (auto &col : _columns)
 	{
-	  bool matched = false;
+	  if (idx / 64 < col.valid.size())
+	    col.valid[idx / 64] &= ~(uint64_t(1) << (idx % 64));
+	}
 
-	  for (const auto &range : q.date_ranges())
-	    {
-	      if (range.contains(it.date()))
-		{
-		  matched = true;
-		  break;
-		}
-	    }
+      row.storage = storage;
+      row.seed = storage->seed();
+    }
+}
 
-	  if (!matched)
-	    continue;
-	}
+/* Evaluates PROG on ROWS (ascending item indices) using THREAD_COUNT
+   threads, appending the matching rows to MATCHES. Rows are split
+   into chunks of QUERY_CHUNK_SIZE items that threads take in order;
+   each finished chunk advances a frontier of completed chunks, and
+   once NEEDED matches precede the frontier no later chunk is started
+   (or finished). */
 
-      if (q.term())
-	{
-	  activity a (it.storage());
-	  if (!(*q.term())(a))
-	    continue;
-	}
+void
+database::evaluate_rows(const compiled_query &prog,
+			const std::vector<size_t> &rows, int thread_count,
+			size_t needed, const std::atomic<bool> *cancel,
+			std::vector<size_t> &matches) const
+{
+  std::vector<size_t> chunk_start;
 
-      if (to_skip != 0)
-	{
-	  to_skip--;
-	  continue;
-	}
+  for (size_t i = 0; i < rows.size(); i++)
+    {
+      if (i == 0 || rows[i] / QUERY_CHUNK_SIZE
+	  != rows[i-1] / QUERY_CHUNK_SIZE)
+	chunk_start.push_back(i);
+    }
 
-      result.push_back(it);
+  size_t chunk_count = chunk_start.size();
+  chunk_start.push_back(rows.size());
 
-      if (--to_add == 0)
-	break;
+  if ((size_t)thread_count > chunk_count)
+    thread_count = std::max((int)chunk_count, 1);
+
+  // Field columns must not be resized while threads are reading them.
+
+  std::vector<field_id> ids;
+  prog.column_fields(ids);
+  prepare_columns(ids);
+
+  std::vector<std::vector<size_t>> chunk_matches(chunk_count);
+  std::vector<bool> chunk_done(chunk_count);
+  size_t frontier = 0;
+  size_t frontier_matches = 0;
+  std::mutex mutex;
+
+  std::atomic<size_t> next_chunk(0);
+  std::atomic<size_t> last_chunk(SIZE_T_MAX);
+
+  auto worker = [&] () {
+    std::vector<size_t> matches;
+
+    while (1)
+      {
+	size_t k = next_chunk++;
+	if (k >= chunk_count || k > last_chunk)
+	  break;
+
+	matches.clear();
+
+	for (size_t i = chunk_start[k]; i < chunk_start[k+1]; i++)
+	  {
+	    if (k > last_chunk)
+	      break;
+
+	    if (cancel != nullptr && cancel->load(std::memory_order_relaxed))
+	      return;
+
+	    activity a (_items[rows[i]].storage());
+	    if (prog(*this, rows[i], a))
+	      matches.push_back(rows[i]);
+	  }
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	using std::swap;
+	swap(chunk_matches[k], matches);
+	chunk_done[k] = true;
+
+	while (frontier < chunk_count && chunk_done[frontier])
+	  {
+	    frontier_matches += chunk_matches[frontier].size();
+	    if (frontier_matches >= needed && last_chunk == SIZE_T_MAX)
+	      last_chunk = frontier;
+	    frontier++;
+	  }
+      }
+  };
+
+  std::vector<std::thread> threads;
+
+  for (int i = 1; i < thread_count; i++)
+    threads.emplace_back(worker);
+
+  worker();
+
+  for (auto &it : threads)
+    it.join();
+
+  for (size_t k = 0; k < chunk_count && k <= last_chunk; k++)
+    {
+      matches.insert(matches.end(), chunk_matches[k].begin(),
+		     chunk_matches[k].end());
+    }
+}
+
+database::field_column &
+database::column(field_id id) const
+{
+  if (_columns.size() == 0)
+    _columns.resize(static_cast<size_t>(field_id::custom));
+
+  field_column &col = _columns[static_cast<size_t>(id)];
+
+  if (col.values.size() != _items.size())
+    {
+      col.values.resize(_items.size());
+      col.valid.resize((_items.size() + 63) / 64);
     }
+
+  return col;
+}
+
+void
+database::prepare_columns(const std::vector<field_id> &ids) const
+{
+  if (_column_rows.size() != _items.size())
+    _column_rows.resize(_items.size(), column_row{nullptr, 0});
+
+  for (field_id id : ids)
+    column(id);
+}
+
+double
+database::field_value(size_t idx, field_id id) const
+{
+  activity a(_items[idx].storage());
+  return field_value(idx, id, a);
+}
+
+double
+database::field_value(size_t idx, field_id id, const activity &a) const
+{
+  if (id == field_id::custom)
+    return 0;
+
+  validate_column_row(idx);
+
+  field_column &col = column(id);
+
+  uint64_t bit = uint64_t(1) << (idx % 64);
+
+  if (!(col.valid[idx / 64] & bit))
+    {
+      col.values[idx] = a.field_value(id);
+      col.valid[idx / 64] |= bit;
+    }
+
+  return col.values[idx];
+}
+
+void
+database::modified_storages(std::vector<activity_storage_ref>
+			    &storages) const
+{
+  _dirty_set->modified_storages(storages);
 }
 
+/* With the sync-writes option every file is written and flushed
+   before any of them replaces the original, so there's one pass of
+   fsync() calls and each directory is only flushed once. */
+
 void
 database::synchronize() const
 {
-  for (auto &it : _items)
-    it.storage()->synchronize_file();
+  std::vector<activity_storage_ref> storages;
+  modified_storages(storages);
+
+  synchronize_storages(storages);
+
+  gps_summary_cache::shared_cache().save();
+}
+
+void
+database::synchronize_storages(const std::vector<activity_storage_ref>
+			       &storages)
+{
+  if (!shared_config().sync_writes())
+    {
+      for (const auto &it : storages)
+	it->synchronize_file();
+      return;
+    }
+
+  struct pending_write
+    {
+      activity_storage_ref storage;
+      uint32_t seed;
+      std::string tmp_path;
+      std::string dest_path;
+    };
+
+  std::vector<pending_write> writes;
+
+  for (const auto &it : storages)
+    {
+      if (!it->needs_synchronize())
+	continue;
+
+      writes.resize(writes.size() + 1);
+      pending_write &w = writes.back();
+      w.storage = it;
+      w.seed = it->seed();
+
+      if (!it->write_temp_file(it->path(), w.tmp_path, w.dest_path))
+	writes.pop_back();
+    }
+
+  for (const auto &it : writes)
+    sync_path(it.tmp_path.c_str());
+
+  std::set<std::string> dirs;
+
+  for (const auto &it : writes)
+    {
+      if (rename(it.tmp_path.c_str(), it.dest_path.c_str()) != 0)
+	{
+	  unlink(it.tmp_path.c_str());
+	  continue;
+	}
+
+      it.storage->set_path_seed(it.seed);
+
+      struct stat st;
+      if (stat(it.dest_path.c_str(), &st) == 0)
+	it.storage->set_written_file(file_identity(st));
+
+      dirs.insert(std::string(it.dest_path, 0,
+			      it.dest_path.rfind('/') + 1));
+    }
+
+  for (const auto &it : dirs)
+    sync_path(it.size() != 0 ? it.c_str() : ".");
 }
 
 void
@@ -234,6 +1821,9 @@ database::complete_field_value(const char *field_name, const char *prefix,
   if (type != field_data_type::string && type != field_data_type::keywords)
     return;
 
+  if (type == field_data_type::keywords)
+    validate_keyword_index();
+
   for (const auto &it : _items)
     {
       if (it.date() < first)
@@ -248,14 +1838,11 @@ database::complete_field_value(const char *field_name, const char *prefix,
 	    }
 	  else if (type == field_data_type::keywords)
 	    {
-	      std::vector<std::string> keys;
-	      if (parse_keywords(*s, &keys))
+	      size_t idx = &it - &_items[0];
+	      for (const auto &key : _keyword_index.row_keywords(idx, id))
 		{
-		  for (const auto &it : keys)
-		    {
-		      if (strncasecmp(prefix, it.c_str(), prefix_len) == 0)
-			set.insert(it);
-		    }
+		  if (strncasecmp(prefix, key.c_str(), prefix_len) == 0)
+		    set.insert(key);
 		}
 	    }
 	}
@@ -264,8 +1851,27 @@ database::complete_field_value(const char *field_name, const char *prefix,
   for (const auto &it : set)
     results.push_back(it);
 
-  case_insensitive_string_compare comp;
-  std::sort(results.begin(), results.end(), comp);
+  case_insensitive_string_compare comp;
+  std::sort(results.begin(), results.end(), comp);
+}
+
+void
+database::query_term::compile(compiled_query &prog) const
+{
+  prog.add_call(this);
+}
+
+int
+database::query_term::cost() const
+{
+  return 8;
+}
+
+bool
+database::query_term::candidate_rows(const database &,
+				     std::vector<size_t> &) const
+{
+  return false;
 }
 
 database::not_term::not_term(const const_query_term_ref &t)
@@ -279,6 +1885,68 @@ database::not_term::operator() (const activity &a) const
   return !(*term)(a);
 }
 
+void
+database::not_term::compile(compiled_query &prog) const
+{
+  term->compile(prog);
+  prog.add_not();
+}
+
+int
+database::not_term::cost() const
+{
+  return term->cost();
+}
+
+namespace {
+
+/* Compiles TERMS so evaluation stops at the first result equal to
+   SHORT_CIRCUIT. Cheapest terms go first, otherwise the order given
+   is kept. */
+
+void
+compile_terms(database::compiled_query &prog,
+	      const std::vector<database::const_query_term_ref> &terms,
+	      bool short_circuit)
+{
+  if (terms.size() == 0)
+    {
+      prog.add_constant(!short_circuit);
+      return;
+    }
+
+  std::vector<database::const_query_term_ref> sorted(terms);
+
+  std::stable_sort(sorted.begin(), sorted.end(),
+		   [] (const database::const_query_term_ref &a,
+		       const database::const_query_term_ref &b) {
+		     return a->cost() < b->cost();
+		   });
+
+  std::vector<size_t> jumps;
+
+  for (size_t i = 0; i < sorted.size(); i++)
+    {
+      sorted[i]->compile(prog);
+      if (i + 1 < sorted.size())
+	jumps.push_back(prog.add_jump(short_circuit));
+    }
+
+  for (size_t jump : jumps)
+    prog.set_jump_target(jump);
+}
+
+int
+terms_cost(const std::vector<database::const_query_term_ref> &terms)
+{
+  int cost = 0;
+  for (const auto &t : terms)
+    cost += t->cost();
+  return cost;
+}
+
+} // anonymous namespace
+
 database::and_term::and_term()
 {
 }
@@ -306,6 +1974,49 @@ database::and_term::operator() (const activity &a) const
   return true;
 }
 
+void
+database::and_term::compile(compiled_query &prog) const
+{
+  compile_terms(prog, terms, false);
+}
+
+int
+database::and_term::cost() const
+{
+  return terms_cost(terms);
+}
+
+bool
+database::and_term::candidate_rows(const database &db,
+				   std::vector<size_t> &rows) const
+{
+  bool found = false;
+
+  for (const auto &t : terms)
+    {
+      std::vector<size_t> t_rows;
+      if (!t->candidate_rows(db, t_rows))
+	continue;
+
+      if (!found)
+	{
+	  using std::swap;
+	  swap(rows, t_rows);
+	  found = true;
+	}
+      else
+	{
+	  std::vector<size_t> tem;
+	  std::set_intersection(rows.begin(), rows.end(), t_rows.begin(),
+				t_rows.end(), std::back_inserter(tem));
+	  using std::swap;
+	  swap(rows, tem);
+	}
+    }
+
+  return found;
+}
+
 database::or_term::or_term()
 {
 }
@@ -333,6 +2044,40 @@ database::or_term::operator() (const activity &a) const
   return false;
 }
 
+void
+database::or_term::compile(compiled_query &prog) const
+{
+  compile_terms(prog, terms, true);
+}
+
+int
+database::or_term::cost() const
+{
+  return terms_cost(terms);
+}
+
+bool
+database::or_term::candidate_rows(const database &db,
+				  std::vector<size_t> &rows) const
+{
+  rows.clear();
+
+  for (const auto &t : terms)
+    {
+      std::vector<size_t> t_rows;
+      if (!t->candidate_rows(db, t_rows))
+	return false;
+
+      std::vector<size_t> tem;
+      std::set_union(rows.begin(), rows.end(), t_rows.begin(),
+		     t_rows.end(), std::back_inserter(tem));
+      using std::swap;
+      swap(rows, tem);
+    }
+
+  return true;
+}
+
 database::equal_term::equal_term(const std::string &f,
 				 const std::string &v)
 : field(f),
@@ -349,6 +2094,18 @@ database::equal_term::operator()(const activity &a) const
     return false;
 }
 
+void
+database::equal_term::compile(compiled_query &prog) const
+{
+  prog.add_equal(field, value);
+}
+
+int
+database::equal_term::cost() const
+{
+  return 2;
+}
+
 database::matches_term::matches_term(const std::string &f,
 				     const std::string &re)
 : field(f),
@@ -372,6 +2129,21 @@ database::matches_term::operator()(const activity &a) const
   return false;
 }
 
+void
+database::matches_term::compile(compiled_query &prog) const
+{
+  if (status == 0)
+    prog.add_matches(field, &compiled);
+  else
+    prog.add_constant(false);
+}
+
+int
+database::matches_term::cost() const
+{
+  return 5;
+}
+
 database::defines_term::defines_term(const std::string &f)
 : field(f)
 {
@@ -383,6 +2155,18 @@ database::defines_term::operator()(const activity &a) const
   return a.storage()->field_ptr(field) != nullptr;
 }
 
+void
+database::defines_term::compile(compiled_query &prog) const
+{
+  prog.add_defines(field);
+}
+
+int
+database::defines_term::cost() const
+{
+  return 1;
+}
+
 database::contains_term::contains_term(const std::string &f,
 				       const std::string &k)
 : field(f),
@@ -391,24 +2175,59 @@ database::contains_term::contains_term(const std::string &f,
 }
 
 bool
-database::contains_term::operator()(const activity &a) const
+database::contains_term::contains_keyword(const std::string &str,
+					  const std::string &key)
 {
-  if (const std::string *str = a.storage()->field_ptr(field))
+  std::vector<std::string> keys;
+  if (parse_keywords(str, &keys))
     {
-      std::vector<std::string> keys;
-      if (parse_keywords(*str, &keys))
+      for (const auto &it : keys)
 	{
-	  for (const auto &it : keys)
-	    {
-	      if (strcasecmp(it.c_str(), keyword.c_str()) == 0)
-		return true;
-	    }
+	  if (strcasecmp(it.c_str(), key.c_str()) == 0)
+	    return true;
 	}
     }
 
   return false;
 }
 
+bool
+database::contains_term::operator()(const activity &a) const
+{
+  if (const std::string *str = a.storage()->field_ptr(field))
+    return contains_keyword(*str, keyword);
+  else
+    return false;
+}
+
+void
+database::contains_term::compile(compiled_query &prog) const
+{
+  prog.add_contains(field, keyword);
+}
+
+int
+database::contains_term::cost() const
+{
+  return 4;
+}
+
+bool
+database::contains_term::candidate_rows(const database &db,
+					std::vector<size_t> &rows) const
+{
+  field_id id = lookup_field_id(field.c_str());
+  if (!keyword_index::indexed_field_p(id))
+    return false;
+
+  if (const std::vector<size_t> *ptr = db.keywords().find(id, keyword))
+    rows = *ptr;
+  else
+    rows.clear();
+
+  return true;
+}
+
 database::compare_term::compare_term(const std::string &f,
 				     compare_op o, double r)
 : field(f),
@@ -418,14 +2237,11 @@ database::compare_term::compare_term(const std::string &f,
 }
 
 bool
-database::compare_term::operator()(const activity &a) const
+database::compare_term::compare_field(const activity &a, field_id id,
+				      field_data_type type,
+				      const std::string &field,
+				      compare_op op, double rhs)
 {
-  field_id id = lookup_field_id(field.c_str());
-
-  field_data_type type = lookup_field_data_type(id);
-  if (type == field_data_type::string)
-    type = field_data_type::number;
-
   /* Use activity to read known fields, e.g. this ensures we fill in
      missing fields from any GPS file. */
 
@@ -443,10 +2259,16 @@ database::compare_term::operator()(const activity &a) const
 	return false;
     }
 
+  return compare_values(lhs, type, op, rhs);
+}
+
+bool
+database::compare_term::compare_values(double lhs, field_data_type type,
+				       compare_op op, double rhs)
+{
   /* FIXME: hack -- comparison order needs to be inverted for pace, as
      the values are converted to speed (1/pace). */
 
-  double rhs = this->rhs;
   if (type == field_data_type::pace)
     lhs = 1/lhs, rhs = 1/rhs;
 
@@ -469,6 +2291,30 @@ database::compare_term::operator()(const activity &a) const
   return false;
 }
 
+bool
+database::compare_term::operator()(const activity &a) const
+{
+  field_id id = lookup_field_id(field.c_str());
+
+  field_data_type type = lookup_field_data_type(id);
+  if (type == field_data_type::string)
+    type = field_data_type::number;
+
+  return compare_field(a, id, type, field, op, rhs);
+}
+
+void
+database::compare_term::compile(compiled_query &prog) const
+{
+  prog.add_compare(field, op, rhs);
+}
+
+int
+database::compare_term::cost() const
+{
+  return 3;
+}
+
 database::grep_term::grep_term(const std::string &re)
 : regexp(re)
 {
@@ -484,4 +2330,275 @@ database::grep_term::operator()(const activity &a) const
   return regexec(&compiled, a.body().c_str(), 0, nullptr, 0) == 0;
 }
 
+void
+database::grep_term::compile(compiled_query &prog) const
+{
+  if (status == 0)
+    prog.add_grep(&compiled);
+  else
+    prog.add_constant(false);
+}
+
+int
+database::grep_term::cost() const
+{
+  return 6;
+}
+
+bool
+database::grep_term::candidate_rows(const database &db,
+				    std::vector<size_t> &rows) const
+{
+  if (status != 0)
+    return false;
+
+  trigram_index::trigram_set set;
+  if (!trigram_index::regexp_trigrams(regexp, set))
+    return false;
+
+  return db.find_body_trigrams(set, rows);
+}
+
+database::compiled_query::insn::insn(opcode o)
+: op(o),
+  value(false),
+  id(field_id::custom),
+  type(field_data_type::string),
+  compare_op(compare_term::compare_op::equal),
+  rhs(0),
+  target(0),
+  handle(nullptr),
+  regex(nullptr),
+  term(nullptr)
+{
+}
+
+database::compiled_query::compiled_query()
+{
+}
+
+database::compiled_query::compiled_query(const const_query_term_ref &term)
+: _term(term)
+{
+  if (_term)
+    _term->compile(*this);
+}
+
+bool
+database::compiled_query::operator() (const activity &a) const
+{
+  return evaluate(a, nullptr, 0);
+}
+
+bool
+database::compiled_query::operator() (const database &db, size_t idx,
+				      const activity &a) const
+{
+  return evaluate(a, &db, idx);
+}
+
+bool
+database::compiled_query::evaluate(const activity &a, const database *db,
+				   size_t idx) const
+{
+  bool r = true;
+
+  size_t pc = 0;
+  size_t count = _program.size();
+
+  while (pc < count)
+    {
+      const insn &i = _program[pc++];
+
+      switch (i.op)
+	{
+	case opcode::constant:
+	  r = i.value;
+	  break;
+
+	case opcode::call:
+	  r = (*i.term)(a);
+	  break;
+
+	case opcode::not_:
+	  r = !r;
+	  break;
+
+	case opcode::jump_if_false:
+	  if (!r)
+	    pc = i.target;
+	  break;
+
+	case opcode::jump_if_true:
+	  if (r)
+	    pc = i.target;
+	  break;
+
+	case opcode::equal:
+	  {
+	    const activity_storage &storage = *a.storage();
+	    int idx = storage.field_index(i.field);
+	    value_pool::handle h;
+	    if (idx < 0)
+	      r = false;
+	    else if (i.handle != nullptr
+		     && (h = storage.value_handle(idx)) != nullptr)
+	      r = h == i.handle;
+	    else
+	      r = storage[idx] == i.string;
+	  }
+	  break;
+
+	case opcode::matches:
+	  if (const std::string *str = a.storage()->field_ptr(i.field))
+	    r = regexec(i.regex, str->c_str(), 0, nullptr, 0) == 0;
+	  else
+	    r = false;
+	  break;
+
+	case opcode::contains:
+	  if (db != nullptr && keyword_index::indexed_field_p(i.id))
+	    r = db->keywords().row_contains(idx, i.id, i.string);
+	  else if (const std::string *str = a.storage()->field_ptr(i.field))
+	    r = contains_term::contains_keyword(*str, i.string);
+	  else
+	    r = false;
+	  break;
+
+	case opcode::defines:
+	  r = a.storage()->field_ptr(i.field) != nullptr;
+	  break;
+
+	case opcode::compare:
+	  if (db != nullptr && i.id != field_id::custom)
+	    {
+	      double lhs = db->field_value(idx, i.id, a);
+	      r = lhs != 0 && compare_term::compare_values(lhs, i.type,
+							   i.compare_op, i.rhs);
+	    }
+	  else
+	    {
+	      r = compare_term::compare_field(a, i.id, i.type, i.field,
+					      i.compare_op, i.rhs);
+	    }
+	  break;
+
+	case opcode::grep:
+	  r = regexec(i.regex, a.body().c_str(), 0, nullptr, 0) == 0;
+	  break;
+	}
+    }
+
+  return r;
+}
+
+void
+database::compiled_query::column_fields(std::vector<field_id> &ids) const
+{
+  for (const auto &i : _program)
+    {
+      if (i.op == opcode::compare && i.id != field_id::custom)
+	ids.push_back(i.id);
+    }
+}
+
+void
+database::compiled_query::add_constant(bool value)
+{
+  _program.push_back(insn(opcode::constant));
+  _program.back().value = value;
+}
+
+void
+database::compiled_query::add_call(const query_term *term)
+{
+  _program.push_back(insn(opcode::call));
+  _program.back().term = term;
+}
+
+void
+database::compiled_query::add_not()
+{
+  _program.push_back(insn(opcode::not_));
+}
+
+size_t
+database::compiled_query::add_jump(bool if_true)
+{
+  _program.push_back(insn(if_true ? opcode::jump_if_true
+			  : opcode::jump_if_false));
+  return _program.size() - 1;
+}
+
+void
+database::compiled_query::set_jump_target(size_t jump)
+{
+  _program[jump].target = _program.size();
+}
+
+void
+database::compiled_query::add_equal(const std::string &field,
+				    const std::string &value)
+{
+  _program.push_back(insn(opcode::equal));
+  _program.back().field = field;
+  _program.back().string = value;
+
+  // Rows with pooled values are compared by handle. Interning the
+  // value would keep it forever, if no activity has it yet rows are
+  // compared by string.
+
+  if (field_atom(field).pooled_value_p())
+    _program.back().handle = value_pool::find(value);
+}
+
+void
+database::compiled_query::add_matches(const std::string &field,
+				      const regex_t *re)
+{
+  _program.push_back(insn(opcode::matches));
+  _program.back().field = field;
+  _program.back().regex = re;
+}
+
+void
+database::compiled_query::add_contains(const std::string &field,
+				       const std::string &key)
+{
+  _program.push_back(insn(opcode::contains));
+  _program.back().field = field;
+  _program.back().id = lookup_field_id(field.c_str());
+  _program.back().string = key;
+}
+
+void
+database::compiled_query::add_defines(const std::string &field)
+{
+  _program.push_back(insn(opcode::defines));
+  _program.back().field = field;
+}
+
+void
+database::compiled_query::add_compare(const std::string &field,
+				      compare_term::compare_op op, double rhs)
+{
+  _program.push_back(insn(opcode::compare));
+
+  insn &i = _program.back();
+  i.field = field;
+  i.id = lookup_field_id(field.c_str());
+  i.type = lookup_field_data_type(i.id);
+  if (i.type == field_data_type::string)
+    i.type = field_data_type::number;
+  i.compare_op = op;
+  i.rhs = rhs;
+}
+
+void
+database::compiled_query::add_grep(const regex_t *re)
+{
+  _program.push_back(insn(opcode::grep));
+  _program.back().regex = re;
+}
+
 } // namespace act
@@ -26,29 +26,67 @@
 #define ACT_DATABASE_H
 
 #include "act-activity.h"
+#include "act-database-index.h"
 
+#include <atomic>
 #include <memory>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <regex.h>
+#include <sys/types.h>
 
 namespace act {
 
+class database_cache;
+
 class database : public uncopyable
 {
 public:
   database();
   database(const database &rhs);
+  ~database();
 
   void clear();
 
   void reload();
   void reload(const char *path);
 
+  // Only loads activities from the YYYY/MM directories that overlap
+  // 'dates' (and any files not following that layout). An empty
+  // vector loads everything.
+
+  void reload(const std::vector<date_range> &dates);
+  void reload(const char *path, const std::vector<date_range> &dates);
+
+  // If true, reload() only reads the headers of activity files, each
+  // body is read when it's first used. Useful when few or no bodies
+  // will be looked at.
+
+  void set_defer_bodies(bool flag);
+  bool defer_bodies() const;
+
   bool add_activity(const char *path);
 
+  // Returns the index of the item read from PATH, or -1.
+
+  ssize_t find_activity(const char *path) const;
+
+  void remove_item(size_t idx);
+
+  // Removes the items at ROWS (sorted, no duplicates) in one pass.
+
+  void remove_items(const std::vector<size_t> &rows);
+
+  // Writes the activities modified since they were last written.
+
   void synchronize() const;
 
+  // Appends the storages of items that may need writing to STORAGES.
+
+  void modified_storages(std::vector<activity_storage_ref> &storages) const;
+
   void complete_field_name(const char *prefix,
     std::vector<std::string> &results) const;
   void complete_field_value(const char *field_name, const char *prefix,
@@ -76,11 +114,73 @@ public:
   std::vector<item> &items();
   const std::vector<item> &items() const;
 
+  // Collects new activities and field edits, then applies them to
+  // the database in one pass, e.g. when importing many files. The
+  // database is unchanged until commit().
+
+  class batch : public uncopyable
+    {
+    public:
+      explicit batch(database &db);
+
+      // Reads the file at PATH, returns false if it's not an
+      // activity. Like database::add_activity() it replaces any item
+      // with the same date.
+
+      bool add_activity(const char *path);
+
+      void set_field(const activity_storage_ref &storage,
+	const std::string &name, const std::string &value);
+      void delete_field(const activity_storage_ref &storage,
+	const std::string &name);
+
+      size_t size() const;
+
+      // Applies the changes, then writes the files of the activities
+      // that were edited. The batch is empty afterwards. Existing
+      // items replaced by new ones with the same date are appended to
+      // REPLACED, if non-null.
+
+      void commit(std::vector<item> *replaced = nullptr);
+
+    private:
+      struct edit
+	{
+	  activity_storage_ref storage;
+	  std::string name;
+	  std::string value;
+	  bool remove;
+	};
+
+      database &_db;
+      std::vector<item> _items;
+      std::vector<edit> _edits;
+    };
+
+  class compiled_query;
+
   class query_term
     {
     public:
       virtual ~query_term() {}
       virtual bool operator() (const activity &a) const = 0;
+
+      // Appends the term to PROG. The default implementation emits a
+      // call to operator().
+
+      virtual void compile(compiled_query &prog) const;
+
+      // Relative cost of evaluating the term, used to reorder the
+      // children of and_term and or_term.
+
+      virtual int cost() const;
+
+      // If only a known subset of DB's items can match the term,
+      // sets ROWS to their sorted indices and returns true. The
+      // default implementation returns false.
+
+      virtual bool candidate_rows(const database &db,
+	std::vector<size_t> &rows) const;
     };
 
   typedef std::shared_ptr<query_term> query_term_ref;
@@ -94,6 +194,8 @@ public:
       explicit not_term(const const_query_term_ref &t);
 
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
     };
 
   class and_term : public query_term
@@ -107,6 +209,10 @@ public:
       void add_term(const const_query_term_ref &t);
 
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
+      virtual bool candidate_rows(const database &db,
+	std::vector<size_t> &rows) const;
     };
 
   class or_term : public query_term
@@ -120,6 +226,10 @@ public:
       void add_term(const const_query_term_ref &t);
 
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
+      virtual bool candidate_rows(const database &db,
+	std::vector<size_t> &rows) const;
     };
 
   class equal_term : public query_term
@@ -131,6 +241,8 @@ public:
       equal_term(const std::string &field, const std::string &value);
 
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
     };
 
   class matches_term : public query_term
@@ -144,6 +256,8 @@ public:
       matches_term(const std::string &field, const std::string &regexp);
 
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
     };
 
   class contains_term : public query_term
@@ -154,7 +268,14 @@ public:
     public:
       contains_term(const std::string &field, const std::string &key);
 
+      static bool contains_keyword(const std::string &str,
+	const std::string &key);
+
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
+      virtual bool candidate_rows(const database &db,
+	std::vector<size_t> &rows) const;
     };
 
   class defines_term : public query_term
@@ -165,6 +286,8 @@ public:
       defines_term(const std::string &field);
 
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
     };
 
   class compare_term : public query_term
@@ -188,7 +311,15 @@ public:
     public:
       compare_term(const std::string &field, compare_op op, double rhs);
 
+      static bool compare_field(const activity &a, field_id id,
+	field_data_type type, const std::string &field, compare_op op,
+	double rhs);
+      static bool compare_values(double lhs, field_data_type type,
+	compare_op op, double rhs);
+
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
     };
 
   class grep_term : public query_term
@@ -201,6 +332,94 @@ public:
       grep_term(const std::string &regexp);
 
       virtual bool operator() (const activity &a) const;
+      virtual void compile(compiled_query &prog) const;
+      virtual int cost() const;
+      virtual bool candidate_rows(const database &db,
+	std::vector<size_t> &rows) const;
+    };
+
+  /* A query term flattened into a linear program: field ids and
+     types are looked up once, the children of and/or terms are
+     reordered so the cheapest are evaluated first, and evaluation is
+     a loop over an instruction vector with short-circuit jumps. */
+
+  class compiled_query
+    {
+    public:
+      compiled_query();
+      explicit compiled_query(const const_query_term_ref &term);
+
+      bool operator() (const activity &a) const;
+
+      // A is the activity of DB.items()[IDX], numeric comparisons
+      // read DB's field columns and keyword tests its keyword index,
+      // which must be valid.
+
+      bool operator() (const database &db, size_t idx,
+	const activity &a) const;
+
+      // Appends the ids of the fields read from DB's field columns.
+
+      void column_fields(std::vector<field_id> &ids) const;
+
+      // Used by query_term::compile() implementations. Each
+      // instruction sets the result register, jumps test it.
+
+      void add_constant(bool value);
+      void add_call(const query_term *term);
+      void add_not();
+      size_t add_jump(bool if_true);
+      void set_jump_target(size_t jump);
+      void add_equal(const std::string &field, const std::string &value);
+      void add_matches(const std::string &field, const regex_t *re);
+      void add_contains(const std::string &field, const std::string &key);
+      void add_defines(const std::string &field);
+      void add_compare(const std::string &field,
+	compare_term::compare_op op, double rhs);
+      void add_grep(const regex_t *re);
+
+    private:
+      enum class opcode
+	{
+	  constant,
+	  call,
+	  not_,
+	  jump_if_false,
+	  jump_if_true,
+	  equal,
+	  matches,
+	  contains,
+	  defines,
+	  compare,
+	  grep,
+	};
+
+      struct insn
+	{
+	  opcode op;
+	  bool value;
+	  field_id id;
+	  field_data_type type;
+	  compare_term::compare_op compare_op;
+	  double rhs;
+	  size_t target;
+	  std::string field;
+	  std::string string;
+	  value_pool::handle handle;
+	  const regex_t *regex;
+	  const query_term *term;
+
+	  explicit insn(opcode op);
+	};
+
+      std::vector<insn> _program;
+
+      bool evaluate(const activity &a, const database *db,
+	size_t idx) const;
+
+      // keeps the terms (and their compiled regexps) alive.
+
+      const_query_term_ref _term;
     };
 
   class query
@@ -209,11 +428,12 @@ public:
 
       size_t _max_count;
       size_t _skip_count;
+      time_t _resume_date;
 
       const_query_term_ref _term;
 
     public:
-      query() : _max_count(SIZE_T_MAX), _skip_count(0) {}
+      query() : _max_count(SIZE_T_MAX), _skip_count(0), _resume_date(0) {}
 
       std::vector<date_range> &date_ranges() {return _dates;};
       const std::vector<date_range> &date_ranges() const {return _dates;};
@@ -227,16 +447,283 @@ public:
       size_t skip_count() const {return _skip_count;}
       void set_skip_count(size_t n) {_skip_count = n;}
 
+      // If non-zero only items older than this date are visited, so
+      // passing query_cursor::last_date() continues a previous query
+      // without rescanning the items it returned.
+
+      time_t resume_date() const {return _resume_date;}
+      void set_resume_date(time_t d) {_resume_date = d;}
+
       void set_term(const const_query_term_ref &t) {_term = t;}
       const const_query_term_ref &term() const {return _term;}
     };
 
+  /* Yields the items matching a query in order, evaluating the
+     query term only as far as needed to return the next match. The
+     database must not be modified while the cursor is in use. */
+
+  class query_cursor : public uncopyable
+    {
+    public:
+      query_cursor(const database &db, const query &q);
+
+      // Sets IDX to the index in items() of the next match. Returns
+      // false when there are no more.
+
+      bool next(size_t &idx);
+      bool next(item &it);
+
+      // The date of the last item returned.
+
+      time_t last_date() const;
+
+      // Once *FLAG is set next() returns false. It's checked between
+      // items, also by the threads evaluating a batch.
+
+      void set_cancel_flag(const std::atomic<bool> *flag);
+
+      // FUN is called with the number of items visited so far and
+      // the number there are to visit, after each chunk of items.
+
+      void set_progress_callback(void (*fun) (size_t visited, size_t total,
+	void *ctx), void *ctx);
+
+      size_t visited_count() const;
+      size_t total_count() const;
+
+    private:
+      const database &_db;
+      compiled_query _program;
+      bool _has_term;
+
+      std::vector<std::pair<size_t, size_t>> _slices;
+      std::vector<size_t> _candidates;
+      bool _use_candidates;
+
+      size_t _slice;			// current slice
+      size_t _row;			// next row to visit
+
+      size_t _to_skip;
+      size_t _to_add;
+      int _thread_count;
+
+      std::vector<size_t> _matches;	// next matching rows
+      size_t _match;			// index into _matches
+
+      time_t _last_date;
+
+      const std::atomic<bool> *_cancel;
+      void (*_progress_fn) (size_t visited, size_t total, void *ctx);
+      void *_progress_ctx;
+      size_t _visited;
+      size_t _total;
+
+      bool cancelled() const;
+      bool next_row(size_t &idx);
+      bool fill_matches();
+    };
+
+  /* Runs a query on a worker thread, e.g. to keep a user interface
+     responsive. The cursor is set up on the calling thread, then the
+     delegate is called on the worker thread as the query progresses.
+     cancel() stops the worker within one chunk of items per thread.
+     The database must not be modified, or queried on other threads,
+     until the task has finished or been cancelled and waited for; the
+     destructor does both. */
+
+  class query_task : public uncopyable
+    {
+    public:
+      class delegate
+	{
+	public:
+	  virtual ~delegate() {}
+
+	  // Arguments are the task, the items visited and their total.
+
+	  virtual void query_progress(query_task &, size_t, size_t) {}
+
+	  // Not called if the task was cancelled.
+
+	  virtual void query_finished(query_task &task) = 0;
+	};
+
+      query_task(const database &db, const query &q,
+	delegate *d = nullptr);
+      ~query_task();
+
+      void cancel();
+      bool cancelled() const;
+
+      // Blocks until the worker thread has stopped.
+
+      void wait();
+
+      // True once all results are available.
+
+      bool finished() const;
+
+      const std::vector<item> &results() const;
+
+    private:
+      query_cursor _cursor;
+      delegate *_delegate;
+
+      std::atomic<bool> _cancelled;
+      std::atomic<bool> _finished;
+      std::vector<item> _results;
+
+      std::thread _thread;
+
+      static void progress_callback(size_t visited, size_t total,
+	void *ctx);
+      void run();
+    };
+
   void execute_query(const query &q, std::vector<item> &result);
 
+  // As above, but RESULT receives indices into items().
+
+  void execute_query(const query &q, std::vector<size_t> &result);
+
+  /* The result of a query, kept up to date by update(). Between
+     updates only items whose storage seed changed are evaluated
+     again, unless items were added to or removed from the database,
+     in which case all items are visited but only new or modified
+     ones are evaluated. The query's max and skip counts and resume
+     date are ignored. */
+
+  class live_query : public uncopyable
+    {
+    public:
+      live_query(database &db, const query &q);
+      ~live_query();
+
+      // Matching items, newest first.
+
+      const std::vector<item> &items() const;
+
+      // Brings items() up to date with the database, appending the
+      // items that now match to ADDED and those that no longer do to
+      // REMOVED (either may be null). Returns true if items()
+      // changed.
+
+      bool update(std::vector<item> *added = nullptr,
+	std::vector<item> *removed = nullptr);
+
+    private:
+      friend class database;
+
+      struct row
+	{
+	  item it;
+	  uint32_t seed;
+	  bool matched;
+	};
+
+      database *_db;		// null once the database is destroyed
+      compiled_query _program;
+      bool _has_term;
+      std::vector<date_range> _dates;
+
+      std::vector<item> _items;
+      std::unordered_map<const activity_storage *, row> _rows;
+
+      bool _valid;
+      uint64_t _items_serial;
+      uint64_t _journal_serial;
+
+      bool matches(const item &it) const;
+      void insert_item(const item &it);
+      void erase_item(const item &it);
+      bool rebuild(std::vector<item> *added, std::vector<item> *removed);
+    };
+
+  /* Returns the same value as activity::field_value() for the
+     activity of items()[IDX]. Values are cached in one column per
+     field, each row is discarded when its item's storage or storage
+     seed changes. */
+
+  double field_value(size_t idx, field_id id) const;
+  double field_value(size_t idx, field_id id, const activity &a) const;
+
+  /* Keyword index over the Equipment, Weather and Keywords fields,
+     rows are indices into items(). Call validate_keyword_index() to
+     bring it up to date after modifying items or their storage. */
+
+  void validate_keyword_index() const;
+  const keyword_index &keywords() const;
+
+  /* Sets ROWS to the indices of the items whose bodies contain every
+     trigram in SET, see trigram_index. Returns false if the index is
+     disabled by the configuration. */
+
+  bool find_body_trigrams(const trigram_index::trigram_set &set,
+    std::vector<size_t> &rows) const;
+
 private:
   std::vector<item> _items;
+  bool _defer_bodies;
+
+  std::shared_ptr<activity_dirty_set> _dirty_set;
+
+  // Incremented whenever items are added or removed.
+
+  uint64_t _items_serial;
+
+  std::vector<live_query *> _live_queries;
+
+  void trim_journal();
+
+  struct column_row
+    {
+      const_activity_storage_ref storage;
+      uint32_t seed;
+    };
+
+  struct field_column
+    {
+      std::vector<double> values;
+      std::vector<uint64_t> valid;		// bitmap
+    };
+
+  mutable std::vector<column_row> _column_rows;
+  mutable std::vector<field_column> _columns;	// indexed by field_id
+
+  void validate_column_row(size_t idx) const;
+  field_column &column(field_id id) const;
+  void prepare_columns(const std::vector<field_id> &ids) const;
+
+  mutable keyword_index _keyword_index;
+  mutable trigram_index _trigram_index;
+
+  struct reload_state;
+
+  typedef std::vector<std::pair<const activity_storage *,
+    trigram_index::trigram_set>> storage_trigrams;
+
+  static void list_reload_units(const char *path,
+    const std::vector<date_range> &dates, std::vector<std::string> &dirs,
+    std::vector<std::string> &files);
+  void reload_units(const std::vector<std::string> &dirs,
+    const std::vector<std::string> &files, database_cache *cache,
+    int thread_count, storage_trigrams &trigrams);
+  void set_body_trigrams(storage_trigrams &trigrams);
 
   static void reload_callback(const char *path, void *ctx);
+
+  void date_range_slices(const std::vector<date_range> &dates,
+    std::vector<std::pair<size_t, size_t>> &slices) const;
+
+  void merge_items(std::vector<item> &items,
+    std::vector<item> *replaced = nullptr);
+
+  static void synchronize_storages(
+    const std::vector<activity_storage_ref> &storages);
+
+  void evaluate_rows(const compiled_query &prog,
+    const std::vector<size_t> &rows, int thread_count, size_t needed,
+    const std::atomic<bool> *cancel, std::vector<size_t> &matches) const;
 };
 
 // implementation details
@@ -247,6 +734,18 @@ database::item::item()
 {
 }
 
+inline void
+database::set_defer_bodies(bool flag)
+{
+  _defer_bodies = flag;
+}
+
+inline bool
+database::defer_bodies() const
+{
+  return _defer_bodies;
+}
+
 inline std::vector<database::item> &
 database::items()
 {
@@ -259,6 +758,54 @@ database::items() const
   return _items;
 }
 
+inline const std::vector<database::item> &
+database::live_query::items() const
+{
+  return _items;
+}
+
+inline size_t
+database::query_cursor::visited_count() const
+{
+  return _visited;
+}
+
+inline size_t
+database::query_cursor::total_count() const
+{
+  return _total;
+}
+
+inline bool
+database::query_cursor::cancelled() const
+{
+  return _cancel != nullptr && _cancel->load(std::memory_order_relaxed);
+}
+
+inline bool
+database::query_task::cancelled() const
+{
+  return _cancelled;
+}
+
+inline bool
+database::query_task::finished() const
+{
+  return _finished;
+}
+
+inline const std::vector<database::item> &
+database::query_task::results() const
+{
+  return _results;
+}
+
+inline const keyword_index &
+database::keywords() const
+{
+  return _keyword_index;
+}
+
 inline bool
 database::item::operator==(const item &rhs) const
 {
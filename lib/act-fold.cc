@@ -28,10 +28,12 @@
 #include "act-config.h"
 #include "act-database.h"
 #include "act-format.h"
+#include "act-gps-summary-cache.h"
 #include "act-output-table.h"
 #include "act-util.h"
 
 #include <map>
+#include <unordered_map>
 #include <xlocale.h>
 
 using namespace act;
@@ -99,7 +101,8 @@ struct group
 
   group(const field_vec &fields);
 
-  void add_activity(const Key &key, const activity &a);
+  activity_accum &accum(const Key &key);
+  void add_activity(const Key &key, const double *values);
 };
 
 struct string_group
@@ -107,9 +110,14 @@ struct string_group
 {
   const char *field;
 
+  // Pooled values are grouped by their case-folded handle, only
+  // falling back to the map's string comparison once per group.
+
+  std::unordered_map<value_pool::handle, activity_accum *> pooled;
+
   explicit string_group(const field_vec &fields, const char *field);
 
-  void insert(const activity &a);
+  void insert(const database &db, size_t row, const double *values);
 
   void format_key(std::string &buf, const std::string &key) const;
 };
@@ -121,7 +129,7 @@ struct keyword_group
 
   keyword_group(const field_vec &fields, const char *field);
 
-  void insert(const activity &a);
+  void insert(const database &db, size_t row, const double *values);
 
   void format_key(std::string &buf, const std::string &key) const;
 };
@@ -136,7 +144,7 @@ struct value_group : public group<int>
   explicit value_group(const field_vec &fields, const char *field,
     double bucket_size);
 
-  void insert(const activity &a);
+  void insert(const database &db, size_t row, const double *values);
 
   void format_key(std::string &buf, int key) const;
 };
@@ -148,7 +156,7 @@ struct interval_group : public group<int>
   explicit interval_group(const field_vec &fields,
     const date_interval &interval);
 
-  void insert(const activity &a);
+  void insert(const database &db, size_t row, const double *values);
 
   void format_key(std::string &buf, int key) const;
 };
@@ -159,13 +167,19 @@ group<Key, Compare>::group(const field_vec &vec)
 {
 }
 
-template<typename Key, typename Compare> void
-group<Key, Compare>::add_activity(const Key &key, const activity &a)
+template<typename Key, typename Compare> activity_accum &
+group<Key, Compare>::accum(const Key &key)
 {
   auto it = map.find(key);
   if (it == map.end())
     it = map.insert(map.begin(), group_pair(key, activity_accum(fields)));
-  it->second.add(a);
+  return it->second;
+}
+
+template<typename Key, typename Compare> void
+group<Key, Compare>::add_activity(const Key &key, const double *values)
+{
+  accum(key).add(values);
 }
 
 string_group::string_group(const field_vec &fields, const char *f)
@@ -175,12 +189,23 @@ string_group::string_group(const field_vec &fields, const char *f)
 }
 
 void
-string_group::insert(const activity &a)
+string_group::insert(const database &db, size_t row, const double *values)
 {
-  if (const std::string *ptr = a.field_ptr(field))
+  const activity_storage &storage = *db.items()[row].storage();
+
+  int idx = storage.field_index(field);
+  if (idx < 0)
+    return;
+
+  if (value_pool::handle h = storage.value_handle(idx))
     {
-      add_activity(*ptr, a);
+      activity_accum *&acc = pooled[h->folded];
+      if (acc == nullptr)
+	acc = &accum(storage[idx]);
+      acc->add(values);
     }
+  else
+    add_activity(storage[idx], values);
 }
 
 void
@@ -196,12 +221,12 @@ keyword_group::keyword_group(const field_vec &fields, const char *f)
 }
 
 void
-keyword_group::insert(const activity &a)
+keyword_group::insert(const database &db, size_t row, const double *values)
 {
-  if (const std::vector<std::string> *ptr = a.field_keywords_ptr(field))
+  if (keyword_index::indexed_field_p(field))
     {
-      for (const auto &it : *ptr)
-	add_activity(it, a);
+      for (const auto &it : db.keywords().row_keywords(row, field))
+	add_activity(it, values);
     }
 }
 
@@ -221,19 +246,20 @@ value_group::value_group(const field_vec &fields, const char *f, double size)
 }
 
 void
-value_group::insert(const activity &a)
+value_group::insert(const database &db, size_t row, const double *values)
 {
   double value = 0;
 
   if (field_id != field_id::custom)
-    value = a.field_value(field_id);
-  else if (const std::string *ptr = a.field_ptr(field))
+    value = db.field_value(row, field_id);
+  else if (const std::string *ptr
+	   = db.items()[row].storage()->field_ptr(field))
     parse_number(*ptr, &value);
 
   if (value == 0)
     return;
 
-  add_activity((int)std::floor(value * bucket_scale), a);
+  add_activity((int)std::floor(value * bucket_scale), values);
 }
 
 void
@@ -258,13 +284,13 @@ interval_group::interval_group(const field_vec &fields, const date_interval &i)
 }
 
 void
-interval_group::insert(const activity &a)
+interval_group::insert(const database &db, size_t row, const double *values)
 {
-  time_t date = a.date();
+  time_t date = db.field_value(row, field_id::date);
   if (date == 0)
     return;
 
-  add_activity(interval.date_index(date), a);
+  add_activity(interval.date_index(date), values);
 }
 
 void
@@ -304,12 +330,28 @@ output_group_table(T &g, const char *format)
 }
 
 template<typename T> void
-apply_group(T &g, const std::vector<database::item> &items,
+apply_group(T &g, const database &db, const database::query &query,
 	    const char *format, const char *table_format)
 {
-  for (const auto &it : items)
-    g.insert(activity(it.storage()));
-  
+  db.validate_keyword_index();
+
+  std::vector<field_id> ids;
+  for (auto field : g.fields)
+    ids.push_back(activity_accum::accum_field_id(field));
+
+  std::vector<double> values(ids.size());
+
+  database::query_cursor cursor(db, query);
+
+  size_t idx;
+  while (cursor.next(idx))
+    {
+      for (size_t i = 0; i < ids.size(); i++)
+	values[i] = db.field_value(idx, ids[i]);
+
+      g.insert(db, idx, values.data());
+    }
+
   if (format != nullptr)
     output_group_format(g, format);
   else if (table_format != nullptr)
@@ -544,10 +586,8 @@ act_fold(arguments &args)
     query.add_date_range(date_range::infinity());
 
   database db;
-  db.reload();
-
-  std::vector<database::item> items;
-  db.execute_query(query, items);
+  db.set_defer_bodies(true);
+  db.reload(query.date_ranges());
 
   std::vector<activity_accum::accum_field> fields
     = activity_accum::format_fields(format ? format : table_format);
@@ -557,25 +597,27 @@ act_fold(arguments &args)
       if (group_keywords)
 	{
 	  keyword_group g(fields, group_field.c_str());
-	  apply_group(g, items, format, table_format);
+	  apply_group(g, db, query, format, table_format);
 	}
       else if (group_size > 0)
 	{
 	  value_group g(fields, group_field.c_str(), group_size);
-	  apply_group(g, items, format, table_format);
+	  apply_group(g, db, query, format, table_format);
 	}
       else
 	{
 	  string_group g(fields, group_field.c_str());
-	  apply_group(g, items, format, table_format);
+	  apply_group(g, db, query, format, table_format);
 	}
     }
   else if (interval.count > 0)
     {
       interval_group g(fields, interval);
-      apply_group(g, items, format, table_format);
+      apply_group(g, db, query, format, table_format);
     }
 
+  gps_summary_cache::shared_cache().save();
+
   return 0;
 }
 
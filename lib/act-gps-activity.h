@@ -265,6 +265,7 @@ public:
   point_vector::iterator points_from(point_field field, float x);
   point_vector::const_iterator points_from(point_field field, float x) const;
 
+  void set_region(const location_region &r) {_region = r;}
   const location_region &region() const {return _region;}
 
   void set_has_location(bool x) {_has_location = x;}
@@ -292,6 +293,10 @@ public:
 
   bool point_at(point_field field, float x, point &ret_p) const;
 
+  // Copies everything but the laps and points of SRC.
+
+  void copy_summary(const activity &src);
+
   // conveniences that call points_from()
 
   point_vector::iterator lap_begin(lap &l);
@@ -299,9 +304,6 @@ public:
 
   point_vector::iterator lap_end(lap &l);
   point_vector::const_iterator lap_end(const lap &l) const;
-
-private:
-  void copy_summary(const activity &src);
 };
 
 // implementation details
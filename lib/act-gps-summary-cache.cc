@@ -0,0 +1,415 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2026 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+
+#include "act-gps-summary-cache.h"
+
+#include "act-cache-file.h"
+#include "act-config.h"
+#include "act-util.h"
+
+#include <sys/stat.h>
+
+#define CACHE_FILE_NAME ".act-gps-summary-cache"
+#define CACHE_MAGIC "ACTGPSSM"
+#define CACHE_VERSION 3
+
+namespace act {
+
+namespace {
+
+/* Each RECORD in the cache file (see act-cache-file.h) is:
+
+	STRING path;
+	int64_t mtime, ctime, size;	-- times in nanoseconds
+	uint64_t hash;			-- of the GPS file's contents
+	SUMMARY summary;
+	uint32_t lap_count;
+	LAP laps[lap_count];
+
+   SUMMARY and LAP are the fields of gps::activity and
+   gps::activity::lap written by append_summary() and append_lap().
+   Records with racy mtimes (see cache_file::racy_mtime()) are written
+   with an mtime of -1, so the GPS file's contents are hashed again
+   before the record is next used. */
+
+using cache_file::reader;
+using cache_file::append;
+using cache_file::append_string;
+
+void
+append_region(std::string &buf, const location_region &r)
+{
+  append(buf, r.center.latitude);
+  append(buf, r.center.longitude);
+  append(buf, r.size.latitude);
+  append(buf, r.size.longitude);
+}
+
+bool
+read_region(reader &in, location_region &r)
+{
+  return (in.read(r.center.latitude) && in.read(r.center.longitude)
+	  && in.read(r.size.latitude) && in.read(r.size.longitude));
+}
+
+void
+append_summary(std::string &buf, const gps::activity &a)
+{
+  append_string(buf, a.activity_id());
+  append_string(buf, a.device());
+  append(buf, (uint32_t)a.sport());
+
+  uint32_t flags = ((a.has_location() << 0) | (a.has_distance() << 1)
+		    | (a.has_speed() << 2) | (a.has_heart_rate() << 3)
+		    | (a.has_cadence() << 4) | (a.has_altitude() << 5)
+		    | (a.has_dynamics() << 6));
+  append(buf, flags);
+
+  append_region(buf, a.region());
+
+  append(buf, a.start_time());
+  append(buf, a.total_elapsed_time());
+  append(buf, a.total_duration());
+  append(buf, a.total_distance());
+  append(buf, a.training_effect());
+  append(buf, a.total_ascent());
+  append(buf, a.total_descent());
+  append(buf, a.total_calories());
+  append(buf, a.avg_speed());
+  append(buf, a.max_speed());
+  append(buf, a.avg_heart_rate());
+  append(buf, a.max_heart_rate());
+  append(buf, a.recovery_heart_rate());
+  append(buf, (double)a.recovery_heart_rate_timestamp());
+  append(buf, a.avg_cadence());
+  append(buf, a.max_cadence());
+  append(buf, a.avg_vertical_oscillation());
+  append(buf, a.avg_stance_time());
+  append(buf, a.avg_stance_ratio());
+}
+
+bool
+read_summary(reader &in, gps::activity &a)
+{
+  std::string str;
+  uint32_t sport, flags;
+  location_region region;
+  double start_time, recovery_time;
+  float elapsed_time, duration, distance, training_effect, ascent;
+  float descent, calories, avg_speed, max_speed, avg_hr, max_hr;
+  float recovery_hr, avg_cadence, max_cadence, avg_vosc;
+  float avg_stance_time, avg_stance_ratio;
+
+  if (!in.read_string(str))
+    return false;
+  a.set_activity_id(str);
+  if (!in.read_string(str))
+    return false;
+  a.set_device(str);
+
+  if (!(in.read(sport) && in.read(flags) && read_region(in, region)
+	&& in.read(start_time) && in.read(elapsed_time)
+	&& in.read(duration) && in.read(distance)
+	&& in.read(training_effect) && in.read(ascent)
+	&& in.read(descent) && in.read(calories) && in.read(avg_speed)
+	&& in.read(max_speed) && in.read(avg_hr) && in.read(max_hr)
+	&& in.read(recovery_hr) && in.read(recovery_time)
+	&& in.read(avg_cadence) && in.read(max_cadence)
+	&& in.read(avg_vosc) && in.read(avg_stance_time)
+	&& in.read(avg_stance_ratio)))
+    return false;
+
+  a.set_sport((gps::activity::sport_type)sport);
+  a.set_has_location(flags & (1U << 0));
+  a.set_has_distance(flags & (1U << 1));
+  a.set_has_speed(flags & (1U << 2));
+  a.set_has_heart_rate(flags & (1U << 3));
+  a.set_has_cadence(flags & (1U << 4));
+  a.set_has_altitude(flags & (1U << 5));
+  a.set_has_dynamics(flags & (1U << 6));
+  a.set_region(region);
+  a.set_start_time(start_time);
+  a.set_total_elapsed_time(elapsed_time);
+  a.set_total_duration(duration);
+  a.set_total_distance(distance);
+  a.set_training_effect(training_effect);
+  a.set_total_ascent(ascent);
+  a.set_total_descent(descent);
+  a.set_total_calories(calories);
+  a.set_avg_speed(avg_speed);
+  a.set_max_speed(max_speed);
+  a.set_avg_heart_rate(avg_hr);
+  a.set_max_heart_rate(max_hr);
+  a.set_recovery_heart_rate(recovery_hr, recovery_time);
+  a.set_avg_cadence(avg_cadence);
+  a.set_max_cadence(max_cadence);
+  a.set_avg_vertical_oscillation(avg_vosc);
+  a.set_avg_stance_time(avg_stance_time);
+  a.set_avg_stance_ratio(avg_stance_ratio);
+
+  return true;
+}
+
+void
+append_lap(std::string &buf, const gps::activity::lap &l)
+{
+  append(buf, l.start_elapsed_time);
+  append(buf, l.total_elapsed_time);
+  append(buf, l.total_duration);
+  append(buf, l.total_distance);
+  append(buf, l.total_ascent);
+  append(buf, l.total_descent);
+  append(buf, l.total_calories);
+  append(buf, l.avg_speed);
+  append(buf, l.max_speed);
+  append(buf, l.avg_heart_rate);
+  append(buf, l.max_heart_rate);
+  append(buf, l.avg_cadence);
+  append(buf, l.max_cadence);
+  append(buf, l.avg_vertical_oscillation);
+  append(buf, l.avg_stance_time);
+  append(buf, l.avg_stance_ratio);
+  append_region(buf, l.region);
+}
+
+bool
+read_lap(reader &in, gps::activity::lap &l)
+{
+  return (in.read(l.start_elapsed_time) && in.read(l.total_elapsed_time)
+	  && in.read(l.total_duration) && in.read(l.total_distance)
+	  && in.read(l.total_ascent) && in.read(l.total_descent)
+	  && in.read(l.total_calories) && in.read(l.avg_speed)
+	  && in.read(l.max_speed) && in.read(l.avg_heart_rate)
+	  && in.read(l.max_heart_rate) && in.read(l.avg_cadence)
+	  && in.read(l.max_cadence) && in.read(l.avg_vertical_oscillation)
+	  && in.read(l.avg_stance_time) && in.read(l.avg_stance_ratio)
+	  && read_region(in, l.region));
+}
+
+} // anonymous namespace
+
+gps_summary_cache &
+gps_summary_cache::shared_cache()
+{
+  static gps_summary_cache cache(shared_config().activity_dir());
+  return cache;
+}
+
+gps_summary_cache::gps_summary_cache(const char *dir)
+: _file(dir),
+  _loaded(false),
+  _changed(false)
+{
+  _file.push_back('/');
+  _file.append(CACHE_FILE_NAME);
+}
+
+void
+gps_summary_cache::load()
+{
+  _loaded = true;
+
+  mapped_file map;
+  if (!map.map(_file.c_str()))
+    return;
+
+  const char *payload;
+  size_t payload_size;
+  uint32_t record_count;
+  if (!cache_file::check_header(map.data(), map.size(), CACHE_MAGIC,
+				CACHE_VERSION, payload, payload_size,
+				record_count))
+    return;
+
+  reader in(payload, payload_size);
+
+  for (uint32_t i = 0; i < record_count; i++)
+    {
+      std::string path;
+      entry e;
+      uint32_t lap_count;
+
+      if (!(in.read_string(path) && in.read(e.mtime) && in.read(e.ctime) && in.read(e.size)
+	    && in.read(e.hash)
+	    && read_summary(in, e.summary) && in.read(lap_count)))
+	break;
+
+      auto &laps = e.summary.laps();
+      laps.resize(lap_count);
+
+      bool failed = false;
+      for (auto &l : laps)
+	{
+	  if (!read_lap(in, l))
+	    {
+	      failed = true;
+	      break;
+	    }
+	}
+      if (failed)
+	break;
+
+      _entries[path] = std::move(e);
+    }
+
+  if (_entries.size() != record_count || !in.at_end())
+    _entries.clear();
+}
+
+/* FNV-1a of the file's contents. */
+
+bool
+gps_summary_cache::file_hash(const char *path, uint64_t &hash)
+{
+  mapped_file map;
+  if (!map.map(path))
+    return false;
+
+  uint64_t h = 14695981039346656037ULL;
+  const char *ptr = map.data();
+  for (size_t i = 0; i < map.size(); i++)
+    h = (h ^ (uint8_t)ptr[i]) * 1099511628211ULL;
+
+  hash = h;
+  return true;
+}
+
+bool
+gps_summary_cache::lookup(const std::string &path, gps::activity &data)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+
+  int64_t mtime = file_mtime_ns(st);
+  int64_t ctime = file_ctime_ns(st);
+  uint64_t hash;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!_loaded)
+      load();
+
+    auto it = _entries.find(path);
+    if (it == _entries.end() || it->second.size != st.st_size)
+      return false;
+
+    const entry &e = it->second;
+
+    if (mtime == e.mtime && ctime == e.ctime)
+      {
+	data.copy_summary(e.summary);
+	data.laps() = e.summary.laps();
+	return true;
+      }
+
+    hash = e.hash;
+  }
+
+  // Only the times changed, e.g. copied from another machine, check
+  // the contents. Hashing is done without the lock, other lookups
+  // needn't wait for it.
+
+  uint64_t file_hash_value;
+  if (!file_hash(path.c_str(), file_hash_value) || file_hash_value != hash)
+    return false;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto it = _entries.find(path);
+  if (it == _entries.end() || it->second.hash != hash
+      || it->second.size != st.st_size)
+    return false;
+
+  entry &e = it->second;
+  e.mtime = mtime;
+  e.ctime = ctime;
+  _changed = true;
+
+  data.copy_summary(e.summary);
+  data.laps() = e.summary.laps();
+  return true;
+}
+
+void
+gps_summary_cache::update(const std::string &path,
+			  const gps::activity &data)
+{
+  entry e;
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !file_hash(path.c_str(), e.hash))
+    return;
+
+  e.mtime = file_mtime_ns(st);
+  e.ctime = file_ctime_ns(st);
+  e.size = st.st_size;
+  e.summary.copy_summary(data);
+  e.summary.laps() = data.laps();
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _entries[path] = std::move(e);
+  _changed = true;
+}
+
+bool
+gps_summary_cache::save()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (!_changed)
+    return true;
+
+  std::string buf;
+  cache_file::begin(buf, CACHE_MAGIC, CACHE_VERSION);
+
+  int64_t racy_mtime = cache_file::racy_mtime();
+
+  for (const auto &it : _entries)
+    {
+      const entry &e = it.second;
+
+      append_string(buf, it.first);
+      append(buf, e.mtime < racy_mtime ? e.mtime : -1);
+      append(buf, e.ctime);
+      append(buf, e.size);
+      append(buf, e.hash);
+      append_summary(buf, e.summary);
+
+      append(buf, (uint32_t)e.summary.laps().size());
+      for (const auto &l : e.summary.laps())
+	append_lap(buf, l);
+    }
+
+  if (!cache_file::write(_file.c_str(), buf, (uint32_t)_entries.size()))
+    return false;
+
+  _changed = false;
+  return true;
+}
+
+} // namespace act
@@ -0,0 +1,93 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2026 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+
+#ifndef ACT_GPS_SUMMARY_CACHE_H
+#define ACT_GPS_SUMMARY_CACHE_H
+
+#include "act-gps-activity.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace act {
+
+/* On-disk store of the summaries of parsed GPS files: the totals,
+   laps and region of each gps::activity, without its points. Lets
+   activity fields that fall back to the GPS file be computed without
+   reading it. Records are keyed by the path of the file, and are used
+   while the file's size, mtime and ctime are unchanged, or if only
+   its times changed but its contents still hash the same.
+   All functions may be called from multiple threads. */
+
+class gps_summary_cache : public uncopyable
+{
+public:
+  // The cache stored in the activity directory. Static destructors
+  // don't run on iOS, so it should be saved explicitly once records
+  // may have been added, e.g. database::reload() and synchronize() do.
+
+  static gps_summary_cache &shared_cache();
+
+  explicit gps_summary_cache(const char *dir);
+
+  // Fills the summary of DATA from the record of the GPS file PATH.
+  // Returns false if there's no valid record.
+
+  bool lookup(const std::string &path, gps::activity &data);
+
+  // Stores the summary of DATA, read from PATH, as the record of PATH.
+
+  void update(const std::string &path, const gps::activity &data);
+
+  // Rewrites the cache file if any records were added or changed.
+
+  bool save();
+
+private:
+  struct entry
+    {
+      int64_t mtime;			// nanoseconds
+      int64_t ctime;
+      int64_t size;
+      uint64_t hash;
+      gps::activity summary;
+    };
+
+  std::string _file;
+  std::unordered_map<std::string, entry> _entries;
+  std::mutex _mutex;
+
+  bool _loaded;
+  bool _changed;
+
+  void load();
+
+  static bool file_hash(const char *path, uint64_t &hash);
+};
+
+} // namespace act
+
+#endif /* ACT_GPS_SUMMARY_CACHE_H */
@@ -0,0 +1,389 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2026 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#include "act-gps-track-cache.h"
+
+#include "act-config.h"
+#include "act-util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+#include <time.h>
+
+#define MAX_PREFETCH_THREADS 4
+
+namespace act {
+
+gps_track_cache &
+gps_track_cache::shared_cache()
+{
+  static gps_track_cache cache((size_t)std::max(shared_config()
+    .gps_track_cache_size(), 0) << 20);
+  return cache;
+}
+
+gps_track_cache::gps_track_cache(size_t max_bytes)
+: _max_bytes(max_bytes),
+  _bytes(0),
+  _hits(0),
+  _misses(0),
+  _evictions(0),
+  _prefetches(0),
+  _stopping(false)
+{
+}
+
+gps_track_cache::~gps_track_cache()
+{
+  std::deque<request> queue;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+
+    using std::swap;
+    swap(_queue, queue);
+  }
+
+  for (auto &it : queue)
+    it.promise.set_value(nullptr);
+
+  _queue_cond.notify_all();
+
+  for (auto &it : _workers)
+    it.join();
+}
+
+/* Tracks are parsed without holding the lock, so two threads asking
+   for the same file at once may both read it (unless one of them is
+   a prefetch); the first to finish is cached and the other copy is
+   returned to its caller only. */
+
+gps_track_cache::track_ref
+gps_track_cache::find(const std::string &path)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return nullptr;
+
+  std::shared_future<track_ref> pending;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = _map.find(path);
+    if (it != _map.end())
+      {
+	auto e = it->second;
+	if (e->matches(st))
+	  {
+	    _entries.splice(_entries.begin(), _entries, e);
+	    _hits++;
+	    return e->track;
+	  }
+	erase(e);
+      }
+
+    auto lt = _loading.find(path);
+    if (lt != _loading.end())
+      {
+	pending = lt->second;
+	_hits++;
+      }
+    else
+      _misses++;
+  }
+
+  // A cancelled request yields null, read the file here instead.
+
+  if (pending.valid())
+    {
+      if (track_ref track = pending.get())
+	return track;
+    }
+
+  return load(path, st);
+}
+
+/* Reads PATH, whose stat() gave ST, and caches it if it fits in the
+   budget and wasn't modified in the last second. */
+
+gps_track_cache::track_ref
+gps_track_cache::load(const std::string &path, const struct stat &st)
+{
+  std::shared_ptr<gps::activity> a (new gps::activity);
+  if (!a->read_file(path.c_str()))
+    return nullptr;
+
+  size_t bytes = track_size(*a);
+  int64_t mtime = file_mtime_ns(st);
+  bool racy = mtime >= ((int64_t)time(nullptr) - 1) * 1000000000;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto it = _map.find(path);
+  if (it != _map.end())
+    {
+      auto e = it->second;
+      if (e->matches(st))
+	return a;
+      erase(e);
+    }
+
+  if (bytes <= _max_bytes && !racy)
+    {
+      _entries.push_front(entry{path, mtime, file_ctime_ns(st),
+				st.st_size, a, bytes});
+      _map[path] = _entries.begin();
+      _bytes += bytes;
+      trim();
+    }
+
+  return a;
+}
+
+gps_track_cache::prefetch_group
+gps_track_cache::new_prefetch_group()
+{
+  static std::atomic<prefetch_group> last_group;
+
+  return ++last_group;
+}
+
+std::shared_future<gps_track_cache::track_ref>
+gps_track_cache::prefetch(const std::string &path, prefetch_group group)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // Nothing read could be kept.
+
+  if (_max_bytes == 0)
+    {
+      std::promise<track_ref> none;
+      none.set_value(nullptr);
+      return none.get_future().share();
+    }
+
+  auto lt = _loading.find(path);
+  if (lt != _loading.end())
+    {
+      // If it's still queued GROUP shares the request.
+
+      for (auto &it : _queue)
+	{
+	  if (it.path == path)
+	    {
+	      if (std::find(it.groups.begin(), it.groups.end(), group)
+		  == it.groups.end())
+		it.groups.push_back(group);
+	      break;
+	    }
+	}
+
+      return lt->second;
+    }
+
+  auto it = _map.find(path);
+  if (it != _map.end())
+    {
+      // Don't stat() here, find() will notice if the file changed.
+
+      std::promise<track_ref> done;
+      done.set_value(it->second->track);
+      return done.get_future().share();
+    }
+
+  request req;
+  req.path = path;
+  req.groups.push_back(group);
+  std::shared_future<track_ref> future = req.promise.get_future().share();
+
+  _loading[path] = future;
+  _queue.push_back(std::move(req));
+  _prefetches++;
+
+  if (_workers.empty())
+    {
+      unsigned int count = std::thread::hardware_concurrency();
+      count = std::max(1U, std::min(count, (unsigned int)MAX_PREFETCH_THREADS));
+      for (unsigned int i = 0; i < count; i++)
+	_workers.emplace_back(&gps_track_cache::worker_main, this);
+    }
+
+  _queue_cond.notify_one();
+
+  return future;
+}
+
+void
+gps_track_cache::cancel_prefetches(prefetch_group group)
+{
+  std::vector<request> cancelled;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto out = _queue.begin();
+
+    for (auto &it : _queue)
+      {
+	auto gt = std::find(it.groups.begin(), it.groups.end(), group);
+	if (gt != it.groups.end())
+	  it.groups.erase(gt);
+
+	if (it.groups.empty())
+	  {
+	    _loading.erase(it.path);
+	    cancelled.push_back(std::move(it));
+	  }
+	else
+	  {
+	    if (&*out != &it)
+	      *out = std::move(it);
+	    ++out;
+	  }
+      }
+
+    _queue.erase(out, _queue.end());
+  }
+
+  for (auto &it : cancelled)
+    it.promise.set_value(nullptr);
+}
+
+void
+gps_track_cache::worker_main()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while (true)
+    {
+      _queue_cond.wait(lock, [this] {
+	return _stopping || !_queue.empty();
+      });
+
+      if (_stopping)
+	break;
+
+      request req(std::move(_queue.front()));
+      _queue.pop_front();
+
+      lock.unlock();
+
+      track_ref track;
+      struct stat st;
+      if (stat(req.path.c_str(), &st) == 0)
+	track = load(req.path, st);
+
+      lock.lock();
+
+      // Erased once cached, so find() sees one or the other.
+
+      _loading.erase(req.path);
+      req.promise.set_value(std::move(track));
+    }
+}
+
+void
+gps_track_cache::remove(const std::string &path)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto it = _map.find(path);
+  if (it != _map.end())
+    erase(it->second);
+}
+
+void
+gps_track_cache::clear()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _entries.clear();
+  _map.clear();
+  _bytes = 0;
+}
+
+void
+gps_track_cache::set_max_bytes(size_t n)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _max_bytes = n;
+  trim();
+}
+
+gps_track_cache::statistics
+gps_track_cache::stats() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  statistics s;
+  s.hits = _hits;
+  s.misses = _misses;
+  s.evictions = _evictions;
+  s.prefetches = _prefetches;
+  s.tracks = _entries.size();
+  s.bytes = _bytes;
+  return s;
+}
+
+size_t
+gps_track_cache::track_size(const gps::activity &a)
+{
+  return (sizeof(a) + a.activity_id().capacity() + a.device().capacity()
+	  + a.laps().capacity() * sizeof(gps::activity::lap)
+	  + a.points().capacity() * sizeof(gps::activity::point));
+}
+
+bool
+gps_track_cache::entry::matches(const struct stat &st) const
+{
+  return (mtime == file_mtime_ns(st) && ctime == file_ctime_ns(st)
+	  && size == st.st_size);
+}
+
+void
+gps_track_cache::erase(entry_list::iterator it)
+{
+  _bytes -= it->bytes;
+  _map.erase(it->path);
+  _entries.erase(it);
+}
+
+/* Drops the least recently used tracks until within budget. */
+
+void
+gps_track_cache::trim()
+{
+  while (_bytes > _max_bytes && !_entries.empty())
+    {
+      erase(std::prev(_entries.end()));
+      _evictions++;
+    }
+}
+
+} // namespace act
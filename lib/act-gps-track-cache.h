@@ -0,0 +1,188 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2026 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#ifndef ACT_GPS_TRACK_CACHE_H
+#define ACT_GPS_TRACK_CACHE_H
+
+#include "act-gps-activity.h"
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace act {
+
+/* Parsed GPS files shared by every activity that reads them, keyed by
+   resolved path. The least recently used tracks are dropped once
+   their total size exceeds the byte budget, callers keep their own
+   references so dropped tracks stay valid until they're released. A
+   track is reparsed if its file's size, mtime or ctime changed since
+   it was read, files modified within the last second aren't cached
+   as they may be modified again without their times changing. All
+   functions may be called from multiple threads.
+
+   Files can also be parsed ahead of time by a pool of worker threads,
+   see prefetch(); find() waits for a pending prefetch of its file
+   rather than reading it again. */
+
+class gps_track_cache : public uncopyable
+{
+public:
+  // The cache used by activity::gps_data(), its budget is the
+  // gps-track-cache-size option.
+
+  static gps_track_cache &shared_cache();
+
+  explicit gps_track_cache(size_t max_bytes);
+  ~gps_track_cache();
+
+  typedef std::shared_ptr<const gps::activity> track_ref;
+
+  // Returns the parsed track of the file at PATH, reading it if it
+  // isn't cached (or has changed). Returns null if the file can't be
+  // read.
+
+  track_ref find(const std::string &path);
+
+  // Identifies whoever made a prefetch request, so they can cancel
+  // their requests without affecting anyone else's. Zero is no group,
+  // its requests are only cancelled when the cache is destroyed.
+
+  typedef uint32_t prefetch_group;
+
+  static prefetch_group new_prefetch_group();
+
+  // Queues PATH to be read and cached by a worker thread, unless it's
+  // already cached or queued, or the budget is zero. The returned
+  // future holds the track once it's been read, or null if the file
+  // couldn't be read or the request was cancelled or not made.
+
+  std::shared_future<track_ref> prefetch(const std::string &path,
+    prefetch_group group = 0);
+
+  // Forgets GROUP's queued requests that haven't been started yet,
+  // e.g. when the rows they were made for scroll out of view. A
+  // request also made by another group stays queued for it.
+
+  void cancel_prefetches(prefetch_group group);
+
+  // Drops any track read from PATH.
+
+  void remove(const std::string &path);
+
+  void clear();
+
+  size_t max_bytes() const;
+  void set_max_bytes(size_t n);
+
+  struct statistics
+    {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      uint64_t prefetches;
+      size_t tracks;
+      size_t bytes;
+    };
+
+  statistics stats() const;
+
+  // Approximate memory used by A.
+
+  static size_t track_size(const gps::activity &a);
+
+private:
+  struct entry
+    {
+      std::string path;
+      int64_t mtime;			// nanoseconds
+      int64_t ctime;
+      int64_t size;
+      track_ref track;
+      size_t bytes;
+
+      bool matches(const struct stat &st) const;
+    };
+
+  // Most recently used first.
+
+  typedef std::list<entry> entry_list;
+
+  entry_list _entries;
+  std::unordered_map<std::string, entry_list::iterator> _map;
+  size_t _max_bytes;
+  size_t _bytes;
+
+  uint64_t _hits;
+  uint64_t _misses;
+  uint64_t _evictions;
+  uint64_t _prefetches;
+
+  mutable std::mutex _mutex;
+
+  // Prefetch state: _loading maps the paths of queued or running
+  // requests to their results, _queue holds the requests no worker
+  // has taken yet. Workers are started by the first prefetch().
+
+  struct request
+    {
+      std::string path;
+      std::vector<prefetch_group> groups;
+      std::promise<track_ref> promise;
+    };
+
+  std::unordered_map<std::string, std::shared_future<track_ref>> _loading;
+  std::deque<request> _queue;
+  std::vector<std::thread> _workers;
+  std::condition_variable _queue_cond;
+  bool _stopping;
+
+  track_ref load(const std::string &path, const struct stat &st);
+  void worker_main();
+
+  void erase(entry_list::iterator it);
+  void trim();
+};
+
+// implementation details
+
+inline size_t
+gps_track_cache::max_bytes() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _max_bytes;
+}
+
+} // namespace act
+
+#endif /* ACT_GPS_TRACK_CACHE_H */
@@ -275,13 +275,18 @@ act_log(arguments &args, const char *format)
   else
     query.add_date_range(date_range::infinity());
 
+  // Most formats never print the body, so only read bodies of the
+  // activities that need them (e.g. to match a grep term).
+
   database db;
-  db.reload();
+  db.set_defer_bodies(format == nullptr
+		      || strcasestr(format, "body") == nullptr);
+  db.reload(query.date_ranges());
 
-  std::vector<database::item> items;
-  db.execute_query(query, items);
+  database::query_cursor cursor(db, query);
 
-  for (const auto &it : items)
+  database::item it;
+  while (cursor.next(it))
     {
       if (print_path)
 	printf("%s\n", it.storage()->path());
@@ -28,6 +28,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <signal.h>
 #include <string.h>
@@ -179,6 +180,22 @@ find_file_under_directory(std::string &file, const char *dir)
   return false;
 }
 
+bool
+ignored_file_name_p(const char *name, size_t len)
+{
+  return len == 0 || name[0] == '.' || name[len-1] == '~';
+}
+
+namespace {
+
+inline bool
+ignored_directory_entry_p(const struct dirent *de)
+{
+  return ignored_file_name_p(de->d_name, de->d_namlen);
+}
+
+} // anonymous namespace
+
 void
 map_directory_files(const char *dir,
 		    void (*fun) (const char *path, void *ctx), void *ctx)
@@ -189,11 +206,8 @@ map_directory_files(const char *dir,
     {
       while (struct dirent *de = readdir(d.get()))
 	{
-	  if (de->d_name[0] == '.'
-	      || de->d_name[de->d_namlen-1] == '~')
-	    {
-	      continue;
-	    }
+	  if (ignored_directory_entry_p(de))
+	    continue;
 
 	  std::string file(dir);
 	  file.push_back('/');
@@ -207,6 +221,31 @@ map_directory_files(const char *dir,
     }      
 }
 
+void
+list_directory(const char *dir, std::vector<std::string> &subdirs,
+	       std::vector<std::string> &files)
+{
+  DIR_ptr d(opendir(dir));
+
+  if (d)
+    {
+      while (struct dirent *de = readdir(d.get()))
+	{
+	  if (ignored_directory_entry_p(de))
+	    continue;
+
+	  std::string file(dir);
+	  file.push_back('/');
+	  file.append(de->d_name);
+
+	  if (de->d_type == DT_DIR)
+	    subdirs.push_back(std::move(file));
+	  else
+	    files.push_back(std::move(file));
+	}
+    }
+}
+
 void
 cat_file(const char *src)
 {
@@ -243,6 +282,101 @@ make_path(const char *path)
   return true;
 }
 
+FILE *
+open_replacement_file(const char *path, std::string &tmp_path,
+		      std::string &dest_path)
+{
+  dest_path = path;
+
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode))
+    {
+      if (char *real = realpath(path, nullptr))
+	{
+	  dest_path = real;
+	  free(real);
+	}
+    }
+
+  // A dot-file, so directory scans ignore it.
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), ".%d.tmp", (int)getpid());
+
+  size_t base = dest_path.rfind('/');
+  base = base != std::string::npos ? base + 1 : 0;
+
+  tmp_path = dest_path;
+  tmp_path.insert(base, 1, '.');
+  tmp_path.append(buf);
+
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return nullptr;
+
+  if (stat(dest_path.c_str(), &st) == 0)
+    fchmod(fd, st.st_mode & 07777);
+
+  FILE *fh = fdopen(fd, "w");
+  if (fh == nullptr)
+    {
+      close(fd);
+      unlink(tmp_path.c_str());
+    }
+
+  return fh;
+}
+
+bool
+sync_path(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  bool ret = fsync(fd) == 0;
+  close(fd);
+
+  return ret;
+}
+
+int64_t
+file_mtime_ns(const struct stat &st)
+{
+#if defined(__APPLE__) && __APPLE__
+  const struct timespec &ts = st.st_mtimespec;
+#else
+  const struct timespec &ts = st.st_mtim;
+#endif
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t
+file_ctime_ns(const struct stat &st)
+{
+#if defined(__APPLE__) && __APPLE__
+  const struct timespec &ts = st.st_ctimespec;
+#else
+  const struct timespec &ts = st.st_ctim;
+#endif
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+file_identity::file_identity(const struct stat &st)
+: mtime(file_mtime_ns(st)),
+  ctime(file_ctime_ns(st)),
+  size(st.st_size),
+  inode(st.st_ino)
+{
+}
+
+bool
+file_identity::operator==(const file_identity &rhs) const
+{
+  return (mtime == rhs.mtime && ctime == rhs.ctime
+	  && size == rhs.size && inode == rhs.inode);
+}
+
 bool
 path_has_extension(const char *path, const char *ext)
 {
@@ -252,6 +386,13 @@ path_has_extension(const char *path, const char *ext)
     return false;
 }
 
+void
+strip_trailing_slashes(std::string &path)
+{
+  while (path.size() > 1 && path.back() == '/')
+    path.pop_back();
+}
+
 void
 tilde_expand_file_name(std::string &dest, const char *src)
 {
@@ -440,6 +581,45 @@ popcount(uint32_t x)
   return count;
 }
 
+mapped_file::~mapped_file()
+{
+  if (_addr != nullptr)
+    munmap(_addr, _size);
+}
+
+bool
+mapped_file::map(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      return false;
+    }
+
+  _identity = file_identity(st);
+
+  if (st.st_size == 0)
+    {
+      close(fd);
+      return true;
+    }
+
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (addr == MAP_FAILED)
+    return false;
+
+  _addr = addr;
+  _size = st.st_size;
+  return true;
+}
+
 output_pipe::output_pipe(const char *program_path,
 			 const char *const program_argv[])
 : _program_path(program_path),
@@ -468,6 +648,13 @@ output_pipe::start()
       if (pipe(fds) < 0)
 	return false;
 
+      // GPS files may be decoded on several threads, keep the
+      // children they start from inheriting this pipe (dup2() clears
+      // the flag on our child's stdout).
+
+      fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+      fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
       pid_t pid = vfork();
       switch (pid)
 	{
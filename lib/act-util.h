@@ -29,7 +29,9 @@
 
 #include <dirent.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <string>
+#include <vector>
 
 namespace act {
 
@@ -101,6 +103,56 @@ public:
   DIR *get() const {return dir;}
 };
 
+// Modification and status-change times of ST in nanoseconds, so that
+// a file rewritten within the same second is still seen to change.
+
+int64_t file_mtime_ns(const struct stat &st);
+int64_t file_ctime_ns(const struct stat &st);
+
+// What stat() said about a file, if any of it changes the file has
+// been modified or replaced. Times are in nanoseconds.
+
+struct file_identity
+{
+  int64_t mtime;
+  int64_t ctime;
+  int64_t size;
+  uint64_t inode;
+
+  file_identity() : mtime(0), ctime(0), size(0), inode(0) {}
+  explicit file_identity(const struct stat &st);
+
+  bool operator==(const file_identity &rhs) const;
+  bool operator!=(const file_identity &rhs) const {return !(*this == rhs);}
+};
+
+/* Read-only private mapping of a whole file. Empty files map
+   successfully with a null data pointer. */
+
+class mapped_file
+{
+  void *_addr;
+  size_t _size;
+  file_identity _identity;
+
+public:
+  mapped_file() : _addr(nullptr), _size(0) {}
+  ~mapped_file();
+
+  bool map(const char *path);
+
+  const char *data() const {return static_cast<const char *>(_addr);}
+  size_t size() const {return _size;}
+
+  // The identity of the file that was mapped.
+
+  const file_identity &identity() const {return _identity;}
+
+private:
+  explicit mapped_file(const mapped_file &rhs);
+  mapped_file &operator=(const mapped_file &rhs);
+};
+
 class output_pipe
 {
   const char *_program_path;
@@ -134,17 +186,43 @@ bool matches_word_list(const char *str, const char *lst);
 
 bool find_file_under_directory(std::string &file, const char *dir);
 
-// Ignores common garbage file names, e.g ".*" and "*~"
+// True for common garbage file names, e.g ".*" and "*~"
+
+bool ignored_file_name_p(const char *name, size_t len);
+
+// Ignores names matching ignored_file_name_p().
 
 void map_directory_files(const char *dir,
   void (*fun) (const char *path, void *ctx), void *ctx);
 
+// Non-recursive, appends the paths of the entries of 'dir' to either
+// 'subdirs' or 'files'. Ignores the same names as map_directory_files.
+
+void list_directory(const char *dir, std::vector<std::string> &subdirs,
+  std::vector<std::string> &files);
+
 void cat_file(const char *src);
 
 bool make_path(const char *path);
 
+// Creates a temporary file to be renamed over PATH once written, in
+// the same directory and with the same permissions if PATH exists.
+// Sets TMP_PATH to its name, and DEST_PATH to the file to rename it
+// to (PATH, or the file it links to).
+
+FILE *open_replacement_file(const char *path, std::string &tmp_path,
+  std::string &dest_path);
+
+// Flushes the contents of the file or directory PATH to disk.
+
+bool sync_path(const char *path);
+
 bool path_has_extension(const char *path, const char *ext);
 
+// Removes any trailing slashes from PATH, other than a lone "/".
+
+void strip_trailing_slashes(std::string &path);
+
 void tilde_expand_file_name(std::string &str);
 void tilde_expand_file_name(std::string &dest, const char *src);
 
@@ -349,9 +349,13 @@ copyFileToGPSDirectory(std::string &gps_path)
   act::database::query q;
   q.set_term(term);
 
+  [_controller.controller interruptQueryTask];
+
   std::vector<act::database::item> results;
   _controller.controller.database->execute_query(q, results);
 
+  [_controller.controller resumeQueryTask];
+
   _exists = results.size() != 0;
   _checked = !_exists;
 
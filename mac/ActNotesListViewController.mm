@@ -31,6 +31,7 @@
 
 #import "act-config.h"
 #import "act-format.h"
+#import "act-gps-track-cache.h"
 #import "act-util.h"
 
 #import "AppKitExtensions.h"
@@ -71,6 +72,9 @@
 #define HEADER_STATS_WIDTH 100
 #define HEADER_STATS_HEIGHT 24
 
+// rows either side of the visible ones whose GPS files are prefetched
+#define GPS_PREFETCH_MARGIN 2
+
 #define DRAW_DATE 1U
 #define DRAW_SEPARATOR 2U
 #define DRAW_SELECTED 4U
@@ -121,6 +125,8 @@ struct ActNotesItem
   double duration() const;
   double points() const;
 
+  void prefetch_gps_data(act::gps_track_cache::prefetch_group group) const;
+
   bool same_day_p(const ActNotesItem &other) const;
 
 private:
@@ -145,6 +151,7 @@ private:
 
 @interface ActNotesListViewController ()
 @property(nonatomic, readonly) const std::vector<ActNotesItem> &activities;
+- (void)prefetchVisibleGPSData;
 @end
 
 @implementation ActNotesListViewController
@@ -153,6 +160,8 @@ private:
 
   NSInteger _headerItemIndex;
   struct ActNotesItem::header_stats _headerStats;
+
+  act::gps_track_cache::prefetch_group _prefetchGroup;
 }
 
 @synthesize scrollView = _scrollView;
@@ -189,6 +198,8 @@ private:
    name:NSViewBoundsDidChangeNotification object:_scrollView.contentView];
 
   _headerItemIndex = -1;
+
+  _prefetchGroup = act::gps_track_cache::new_prefetch_group();
 }
 
 - (void)dealloc
@@ -399,6 +410,7 @@ private:
 
   [self updateListViewBounds];
   [self updateHeaderItemIndex];
+  [self prefetchVisibleGPSData];
 
   _listView.needsDisplay = YES;
   _headerView.needsDisplay = YES;
@@ -458,6 +470,38 @@ private:
 - (void)listBoundsDidChange:(NSNotification *)note
 {
   [self updateHeaderItemIndex];
+
+  // Waits for scrolling to pause before prefetching.
+
+  [NSRunLoop cancelPreviousPerformRequestsWithTarget:self
+   selector:@selector(prefetchVisibleGPSData) object:nil];
+  [self performSelector:@selector(prefetchVisibleGPSData) withObject:nil
+   afterDelay:.25];
+}
+
+/* Starts decoding the GPS files of the visible rows, and of a few
+   either side, replacing any requests for rows no longer shown. */
+
+- (void)prefetchVisibleGPSData
+{
+  act::gps_track_cache::shared_cache().cancel_prefetches(_prefetchGroup);
+
+  NSRect r = _listView.visibleRect;
+
+  NSInteger first = [self rowForYPosition:NSMinY(r) startPosition:nullptr];
+  if (first == NSNotFound)
+    return;
+
+  NSInteger last = [self rowForYPosition:NSMaxY(r) startPosition:nullptr];
+  if (last == NSNotFound)
+    last = _activities.size() - 1;
+
+  first = std::max(first - GPS_PREFETCH_MARGIN, (NSInteger)0);
+  last = std::min(last + GPS_PREFETCH_MARGIN,
+		  (NSInteger)_activities.size() - 1);
+
+  for (NSInteger i = first; i <= last; i++)
+    _activities[i].prefetch_gps_data(_prefetchGroup);
 }
 
 - (const ActNotesItem *)headerItem
@@ -1036,6 +1080,16 @@ ActNotesItem::points() const
   return activity->points();
 }
 
+void
+ActNotesItem::prefetch_gps_data
+  (act::gps_track_cache::prefetch_group group) const
+{
+  if (!activity)
+    activity.reset(new act::activity(storage));
+
+  activity->prefetch_gps_data(group);
+}
+
 void
 ActNotesItem::update_body() const
 {
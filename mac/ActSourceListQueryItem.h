@@ -26,8 +26,13 @@
 
 #import "act-database.h"
 
+#import <memory>
+
 @interface ActSourceListQueryItem : ActSourceListItem
 
+/* The badge counts the results of a live query made the first time
+   it's shown, so the query should be set up before then. */
+
 @property(nonatomic, readonly) act::database::query &query;
 
 @end
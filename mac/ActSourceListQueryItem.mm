@@ -27,6 +27,11 @@
 #import "ActWindowController.h"
 
 @implementation ActSourceListQueryItem
+{
+  act::database::query _query;
+  std::unique_ptr<act::database::live_query> _liveQuery;
+  NSInteger _badgeValue;
+}
 
 @synthesize query = _query;
 
@@ -37,10 +42,22 @@
 
 - (NSInteger)badgeValue
 {
-  std::vector<act::database::item> items;
-  self.controller.database->execute_query(_query, items);
+  // Keeps the last count while a search is reading the database, the
+  // controller redraws the badges when it finishes.
+
+  if (self.controller.queryTaskRunning)
+    return _badgeValue;
+
+  if (!_liveQuery)
+    {
+      _liveQuery.reset(new act::database::live_query
+		       (*self.controller.database, _query));
+    }
+  else
+    _liveQuery->update();
 
-  return (NSInteger)items.size();
+  _badgeValue = (NSInteger)_liveQuery->items().size();
+  return _badgeValue;
 }
 
 - (void)select
@@ -75,6 +75,21 @@ enum ActWindowMode
 
 - (void)showQueryResults:(const act::database::query &)query;
 
+/* Searches run on a background thread, and the database can't be used
+   by anything else until they finish. Code that needs it meanwhile
+   calls interruptQueryTask, which cancels the search, and then
+   resumeQueryTask, which starts it again so that its results include
+   any changes. The calls nest, and searches asked for while
+   interrupted start when the outermost resumeQueryTask is called.
+   Callers that only read the database may check queryTaskRunning
+   instead. */
+
+@property(nonatomic, readonly, getter=isQueryTaskRunning)
+    BOOL queryTaskRunning;
+
+- (void)interruptQueryTask;
+- (void)resumeQueryTask;
+
 - (void)synchronize;
 - (void)synchronizeIfNeeded;
 
@@ -43,6 +43,7 @@
 
 #import "act-config.h"
 #import "act-format.h"
+#import "act-gps-track-cache.h"
 #import "act-new.h"
 #import "act-util.h"
 
@@ -51,6 +52,7 @@
 
 #define BODY_WRAP_COLUMN 72
 #define SYNC_DELAY_NS (10LL*NSEC_PER_SEC)
+#define GPS_PREFETCH_NEIGHBOURS 2
 
 enum ActSourceListSections
 {
@@ -72,6 +74,10 @@ NSString *const ActSelectedDeviceDidChange = @"ActSelectedDeviceDidChange";
 
 @interface ActWindowController ()
 - (void)selectedActivityDidChange;
+- (void)prefetchNeighbouringGPSData;
+- (void)cancelQueryTask;
+- (void)queryTaskDidFinish:(NSInteger)generation;
+- (void)activityListDidChangeFromQuery;
 @end
 
 namespace {
@@ -266,6 +272,30 @@ append_string_query_terms(act::database::const_query_term_ref term,
   return modified ? and_term : term;
 }
 
+/* Forwards completion of a background query to the main thread.
+   GENERATION identifies the query, so the controller can ignore
+   queries that have been replaced. */
+
+class query_task_delegate : public act::database::query_task::delegate
+{
+  __weak ActWindowController *_controller;
+  NSInteger _generation;
+
+public:
+  query_task_delegate(ActWindowController *controller, NSInteger generation)
+  : _controller(controller), _generation(generation) {}
+
+  virtual void query_finished(act::database::query_task &task)
+    {
+      ActWindowController *controller = _controller;
+      NSInteger generation = _generation;
+
+      dispatch_async(dispatch_get_main_queue(), ^{
+	[controller queryTaskDidFinish:generation];
+      });
+    }
+};
+
 } // anonymous namespace
 
 @implementation ActWindowController
@@ -281,8 +311,18 @@ append_string_query_terms(act::database::const_query_term_ref term,
   std::unique_ptr<act::database> _database;
   BOOL _needsSynchronize;
 
+  // must be destroyed before _database.
+
+  std::unique_ptr<query_task_delegate> _queryDelegate;
+  std::unique_ptr<act::database::query_task> _queryTask;
+  NSInteger _queryGeneration;
+  act::database::query _query;
+  NSInteger _queryInterruptCount;
+  BOOL _queryTaskInterrupted;
+
   std::vector<act::database::item> _activityList;
   act::activity_storage_ref _selectedActivityStorage;
+  act::gps_track_cache::prefetch_group _prefetchGroup;
   std::unique_ptr<act::activity> _selectedActivity;
   NSInteger _selectedLapIndex;
   double _currentTime;
@@ -559,6 +599,8 @@ append_string_query_terms(act::database::const_query_term_ref term,
   _selectedLapIndex = -1;
   _currentTime = -1;
 
+  _prefetchGroup = act::gps_track_cache::new_prefetch_group();
+
   [_sourceListItems addObject:[ActSourceListItem itemWithName:@"DEVICES"]];
   [_sourceListItems addObject:[ActSourceListItem itemWithName:@"ACTIVITIES"]];
   [_sourceListItems addObject:[ActSourceListItem itemWithName:@"DATE"]];
@@ -830,20 +872,96 @@ append_string_query_terms(act::database::const_query_term_ref term,
 
 - (void)showQueryResults:(const act::database::query &)query
 {
-  _activityList.clear();
+  [self cancelQueryTask];
+
+  _query = query;
 
   NSString *pattern = _searchField.stringValue;
 
   if (pattern.length == 0)
-    self.database->execute_query(query, _activityList);
+    {
+      _activityList.clear();
+      self.database->execute_query(query, _activityList);
+      [self activityListDidChangeFromQuery];
+    }
   else
     {
+      // While interrupted, -resumeQueryTask starts it.
+
+      if (_queryInterruptCount != 0)
+	{
+	  _queryTaskInterrupted = YES;
+	  return;
+	}
+
+      /* Searches may have to read every activity, so run them in the
+	 background to keep typing responsive. The current list stays
+	 until the results arrive. */
+
       act::database::query pattern_query(query);
       pattern_query.set_term(append_string_query_terms
 			     (query.term(), pattern.UTF8String));
-      self.database->execute_query(pattern_query, _activityList);
+
+      _queryDelegate.reset(new query_task_delegate(self, _queryGeneration));
+      _queryTask.reset(new act::database::query_task
+		       (*self.database, pattern_query, _queryDelegate.get()));
     }
+}
+
+- (void)cancelQueryTask
+{
+  _queryGeneration++;
+
+  // Cancels the query and waits for its thread to exit.
+
+  _queryTask.reset();
+  _queryDelegate.reset();
+  _queryTaskInterrupted = NO;
+}
+
+- (BOOL)isQueryTaskRunning
+{
+  return _queryTask != nullptr;
+}
+
+/* The current list stays shown until the restarted search finishes. */
+
+- (void)interruptQueryTask
+{
+  if (_queryInterruptCount++ == 0 && _queryTask)
+    {
+      [self cancelQueryTask];
+      _queryTaskInterrupted = YES;
+    }
+}
+
+- (void)resumeQueryTask
+{
+  if (--_queryInterruptCount == 0 && _queryTaskInterrupted)
+    {
+      _queryTaskInterrupted = NO;
+      [self showQueryResults:_query];
+    }
+}
 
+- (void)queryTaskDidFinish:(NSInteger)generation
+{
+  if (generation != _queryGeneration || !_queryTask)
+    return;
+
+  _queryTask->wait();
+  _activityList = _queryTask->results();
+
+  [self cancelQueryTask];
+  [self activityListDidChangeFromQuery];
+
+  // Badges aren't updated while the query runs.
+
+  [_sourceListView setNeedsDisplay:YES];
+}
+
+- (void)activityListDidChangeFromQuery
+{
   BOOL selection = NO;
   for (auto &it : _activityList)
     {
@@ -863,6 +981,8 @@ append_string_query_terms(act::database::const_query_term_ref term,
 
 - (void)reloadActivities
 {
+  [self cancelQueryTask];
+
   self.selectedActivityStorage = nullptr;
 
   self.database->reload();
@@ -900,6 +1020,41 @@ append_string_query_terms(act::database::const_query_term_ref term,
       _selectedActivity.reset();
 
       [self selectedActivityDidChange];
+      [self prefetchNeighbouringGPSData];
+    }
+}
+
+/* Starts decoding the GPS files of the activities either side of the
+   selection, so that stepping through them doesn't stall. */
+
+- (void)prefetchNeighbouringGPSData
+{
+  act::gps_track_cache::shared_cache().cancel_prefetches(_prefetchGroup);
+
+  if (_selectedActivityStorage == nullptr)
+    return;
+
+  auto it = std::find_if(_activityList.begin(), _activityList.end(),
+			 [=] (const act::database::item &a) {
+			   return a.storage() == _selectedActivityStorage;
+			 });
+  if (it == _activityList.end())
+    return;
+
+  ptrdiff_t idx = it - _activityList.begin();
+
+  for (ptrdiff_t i = 1; i <= GPS_PREFETCH_NEIGHBOURS; i++)
+    {
+      if (idx + i < (ptrdiff_t)_activityList.size())
+	{
+	  act::activity(_activityList[idx + i].storage())
+	    .prefetch_gps_data(_prefetchGroup);
+	}
+      if (idx - i >= 0)
+	{
+	  act::activity(_activityList[idx - i].storage())
+	    .prefetch_gps_data(_prefetchGroup);
+	}
     }
 }
 
@@ -982,10 +1137,14 @@ append_string_query_terms(act::database::const_query_term_ref term,
 
 - (void)synchronize
 {
+  [self interruptQueryTask];
+
   _needsSynchronize = NO;
 
   if (_database)
     _database->synchronize();
+
+  [self resumeQueryTask];
 }
 
 - (void)synchronizeIfNeeded
@@ -1121,6 +1280,8 @@ append_string_query_terms(act::database::const_query_term_ref term,
 - (void)setString:(NSString *)str forField:(NSString *)name
     ofActivity:(act::activity &)a
 {
+  [self interruptQueryTask];
+
   const char *field_name = name.UTF8String;
   auto id = act::lookup_field_id(field_name);
   if (id != act::field_id::custom)
@@ -1142,6 +1303,8 @@ append_string_query_terms(act::database::const_query_term_ref term,
     a.storage()->delete_field(field_name);
 
   [self activity:a.storage() didChangeField:name];
+
+  [self resumeQueryTask];
 }
 
 - (void)deleteField:(NSString *)name
@@ -1167,10 +1330,14 @@ append_string_query_terms(act::database::const_query_term_ref term,
   if (newName.length == 0)
     return [self deleteField:newName ofActivity:a];
 
+  [self interruptQueryTask];
+
   a.storage()->set_field_name(oldName.UTF8String, newName.UTF8String);
 
   [self activity:a.storage() didChangeField:oldName];
   [self activity:a.storage() didChangeField:newName];
+
+  [self resumeQueryTask];
 }
 
 - (NSString *)bodyStringOfActivity:(const act::activity &)a
@@ -1272,10 +1439,14 @@ append_string_query_terms(act::database::const_query_term_ref term,
     {
       // FIXME: undo management
 
+      [self interruptQueryTask];
+
       std::swap(a.storage()->body(), wrapped);
       a.storage()->increment_seed();
 
       [self activityDidChangeBody:a.storage()];
+
+      [self resumeQueryTask];
     }
 }
 
@@ -1355,6 +1526,8 @@ append_string_query_terms(act::database::const_query_term_ref term,
 
 - (void)foreachUnimportedActivityURL:(void (^)(NSURL *url))block
 {
+  [self interruptQueryTask];
+
   for (ActDevice *device in [ActDeviceManager sharedDeviceManager].allDevices)
     {
       for (NSURL *url in device.activityURLs)
@@ -1376,6 +1549,8 @@ append_string_query_terms(act::database::const_query_term_ref term,
 	    }
 	}
     }
+
+  [self resumeQueryTask];
 }
 
 - (void)updateUnimportedActivitiesCount